@@ -5,6 +5,6 @@ LuxemogApp = Define.Executable
 	Name = 'luxemog',
 	Sources = Item() + 'main.cxx',
 	LocalLibraries = Luxemog,
-	LinkFlags = ' -lluxem-cxx'
+	LinkFlags = ' -lluxem-cxx -pthread'
 }
 
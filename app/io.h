@@ -0,0 +1,253 @@
+#ifndef luxemog_app_io_h
+#define luxemog_app_io_h
+
+#include <luxem-cxx/luxem.h>
+
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <cstdint>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+size_t const read_buffer_size = 1 << 20;
+size_t const write_buffer_size = 1 << 20;
+
+// Feeds all of filename ('-' for stdin) to reader.  Regular files are mapped and fed in one piece, 
+// anything else is read through a large buffer.
+template <typename reader_type> void feed_file(reader_type &reader, std::string const &filename)
+{
+	int file = filename == "-" ? STDIN_FILENO : open(filename.c_str(), O_RDONLY);
+	if (file < 0) throw std::runtime_error(std::string("Failed to open file: ") + strerror(errno));
+	luxem::finally finally([&](void) { if (file != STDIN_FILENO) close(file); });
+
+	struct stat file_stat;
+	if ((fstat(file, &file_stat) == 0) && S_ISREG(file_stat.st_mode))
+	{
+		if (file_stat.st_size == 0) 
+		{
+			reader.feed("", 0, true);
+			return;
+		}
+		size_t const length = file_stat.st_size;
+		auto mapping = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, file, 0);
+		if (mapping != MAP_FAILED)
+		{
+			luxem::finally finally([&](void) { munmap(mapping, length); });
+			madvise(mapping, length, MADV_SEQUENTIAL);
+			reader.feed(static_cast<char const *>(mapping), length, true);
+			return;
+		}
+	}
+
+	std::vector<char> buffer(read_buffer_size);
+	size_t kept = 0;
+	while (true)
+	{
+		auto got = read(file, &buffer[kept], buffer.size() - kept);
+		if (got < 0)
+		{
+			if (errno == EINTR) continue;
+			throw std::runtime_error(std::string("Failed to read file: ") + strerror(errno));
+		}
+		size_t const length = kept + got;
+		size_t const eaten = reader.feed(&buffer[0], length, got == 0);
+		if (got == 0) break;
+		kept = length - eaten;
+		if (kept > 0) memmove(&buffer[0], &buffer[eaten], kept);
+		if (kept == buffer.size()) buffer.resize(buffer.size() * 2);
+	}
+}
+
+// Opens the output stream ('-' or empty for stdout) with a large write buffer.  Returns null on failure.
+inline FILE *open_output(std::string const &filename)
+{
+	auto file = (filename.empty() || filename == "-") ? stdout : fopen(filename.c_str(), "wb");
+	if (file) setvbuf(file, nullptr, _IOFBF, write_buffer_size);
+	return file;
+}
+
+// Flushes the output and closes it unless it's stdout, throwing if anything couldn't be written.  Clears
+// file, so cleanup on other paths can close whatever's left.
+inline void close_output(FILE *&file)
+{
+	auto closing = file;
+	file = nullptr;
+	int error = 0;
+	if ((fflush(closing) != 0) || ferror(closing)) error = errno ? errno : EIO;
+	if ((closing != stdout) && (fclose(closing) != 0) && !error) error = errno;
+	if (error) throw std::runtime_error(strerror(error));
+}
+
+// Finds whether the first root value in luxem text is an array, looking past whitespace, comments and its
+// type.  Fed the text so far, from the start, each time.
+struct root_sniffer
+{
+	bool decided = false;
+	bool array = false;
+
+	void feed(char const *data, size_t length, bool finish)
+	{
+		for (; !decided && (seen < length); ++seen)
+		{
+			char const next = data[seen];
+			switch (state)
+			{
+				case in_space:
+					if ((next == ' ') || (next == '\t') || (next == '\n') || (next == '\r')) break;
+					if (next == '*') state = in_comment;
+					else if (next == '(') state = in_type;
+					else
+					{
+						decided = true;
+						array = next == '[';
+					}
+					break;
+				case in_comment:
+					if (next == '\\') state = in_comment_escape;
+					else if (next == '*') state = in_space;
+					break;
+				case in_comment_escape: state = in_comment; break;
+				case in_type:
+					if (next == '\\') state = in_type_escape;
+					else if (next == ')') state = in_space;
+					break;
+				case in_type_escape: state = in_type; break;
+			}
+		}
+		if (finish) decided = true;
+	}
+
+	private:
+		enum { in_space, in_comment, in_comment_escape, in_type, in_type_escape } state = in_space;
+		size_t seen = 0;
+};
+
+// Framing for --serve.  A client sends any number of requests on a connection, each:
+//     u32 name length, name, u8 1 to reverse or 0, u32 SOURCE length, SOURCE
+// and receives a response to each:
+//     u8 0 on success or 1 on error, u32 length, result or error message
+// with lengths in network byte order.
+
+size_t const serve_name_limit = 1 << 12;
+size_t const serve_payload_limit = 1 << 30;
+
+// Returns false if the peer closed the connection before the first byte
+inline bool read_exact(int file, void *buffer, size_t length)
+{
+	size_t done = 0;
+	while (done < length)
+	{
+		auto got = read(file, static_cast<char *>(buffer) + done, length - done);
+		if (got < 0)
+		{
+			if (errno == EINTR) continue;
+			throw std::runtime_error(std::string("Failed to read request: ") + strerror(errno));
+		}
+		if (got == 0)
+		{
+			if (done == 0) return false;
+			throw std::runtime_error("Connection closed mid-request.");
+		}
+		done += got;
+	}
+	return true;
+}
+
+inline void write_exact(int file, void const *buffer, size_t length)
+{
+	size_t done = 0;
+	while (done < length)
+	{
+		auto wrote = write(file, static_cast<char const *>(buffer) + done, length - done);
+		if (wrote < 0)
+		{
+			if (errno == EINTR) continue;
+			throw std::runtime_error(std::string("Failed to write response: ") + strerror(errno));
+		}
+		done += wrote;
+	}
+}
+
+inline void read_required(int file, void *buffer, size_t length)
+{
+	if (!read_exact(file, buffer, length)) throw std::runtime_error("Connection closed mid-request.");
+}
+
+inline uint32_t check_length(uint32_t length, size_t limit)
+{
+	length = ntohl(length);
+	if (length > limit) throw std::runtime_error("Request field too long.");
+	return length;
+}
+
+inline void write_length(int file, size_t length)
+{
+	uint32_t const network_length = htonl(length);
+	write_exact(file, &network_length, sizeof(network_length));
+}
+
+struct serve_request
+{
+	std::string name;
+	bool reverse;
+	std::string source;
+};
+
+// Returns false if the peer closed the connection between requests
+inline bool read_request(int connection, serve_request &request)
+{
+	uint32_t length;
+	if (!read_exact(connection, &length, sizeof(length))) return false;
+	request.name.assign(check_length(length, serve_name_limit), '\0');
+	read_required(connection, &request.name[0], request.name.size());
+	uint8_t reverse;
+	read_required(connection, &reverse, sizeof(reverse));
+	request.reverse = reverse != 0;
+	read_required(connection, &length, sizeof(length));
+	request.source.assign(check_length(length, serve_payload_limit), '\0');
+	read_required(connection, &request.source[0], request.source.size());
+	return true;
+}
+
+inline void write_response(int connection, bool error, std::string const &body)
+{
+	uint8_t const status = error ? 1 : 0;
+	write_exact(connection, &status, sizeof(status));
+	write_length(connection, body.size());
+	write_exact(connection, body.data(), body.size());
+}
+
+// The client side
+
+inline void write_request(int connection, serve_request const &request)
+{
+	if ((request.name.size() > serve_name_limit) || (request.source.size() > serve_payload_limit))
+		throw std::runtime_error("Request field too long.");
+	write_length(connection, request.name.size());
+	write_exact(connection, request.name.data(), request.name.size());
+	uint8_t const reverse = request.reverse ? 1 : 0;
+	write_exact(connection, &reverse, sizeof(reverse));
+	write_length(connection, request.source.size());
+	write_exact(connection, request.source.data(), request.source.size());
+}
+
+// Returns false if the server reported an error, which is then in body
+inline bool read_response(int connection, std::string &body)
+{
+	uint8_t status;
+	read_required(connection, &status, sizeof(status));
+	uint32_t length;
+	read_required(connection, &length, sizeof(length));
+	body.assign(ntohl(length), '\0');
+	read_required(connection, &body[0], body.size());
+	return status == 0;
+}
+
+#endif
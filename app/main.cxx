@@ -1,10 +1,623 @@
 #include <getopt.h>
 #include <iostream>
+#include <fstream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <csignal>
+#include <atomic>
+#include <set>
 
 #include "../library/luxemog.h"
+#include "io.h"
 
 // TODOish getopt_long won't work on Windows with wmain, so I haven't even attempted to get unicode filenames to work in that environment.
 
+size_t const pipeline_depth = 256;
+
+enum data_format { format_luxem, format_binary };
+
+// How SOURCE is read and results are written
+struct io_options
+{
+	data_format in_format = format_luxem;
+	data_format out_format = format_luxem;
+	std::function<void(luxem::writer &writer)> configure_writer; // For luxem output
+};
+
+// Passes each root value of filename, read in format, to callback
+void read_file(
+	data_format format, 
+	std::string const &filename, 
+	std::function<void(std::shared_ptr<luxem::value> &&data)> &&callback)
+{
+	if (format == format_binary)
+	{
+		luxemog::binary_reader reader;
+		reader.build_struct(std::move(callback));
+		feed_file(reader, filename);
+	}
+	else
+	{
+		luxem::reader reader;
+		reader.build_struct(std::move(callback));
+		feed_file(reader, filename);
+	}
+}
+
+// Writes root values in the output format to file, or if file is null to a buffer for dump
+struct value_writer
+{
+	value_writer(io_options const &io, FILE *file = nullptr)
+	{
+		if (io.out_format == format_binary) 
+			binary = file ? std::make_unique<luxemog::binary_writer>(file) : std::make_unique<luxemog::binary_writer>();
+		else
+		{
+			text = file ? std::make_unique<luxem::writer>(file) : std::make_unique<luxem::writer>();
+			io.configure_writer(*text);
+		}
+	}
+
+	void value(luxem::value const &data)
+	{
+		if (binary) binary->value(data);
+		else text->value(data);
+	}
+
+	std::string dump(void) { return binary ? binary->dump() : text->dump(); }
+
+	private:
+		std::unique_ptr<luxem::writer> text;
+		std::unique_ptr<luxemog::binary_writer> binary;
+};
+
+template <typename element_type> struct work_queue
+{
+	void push(element_type &&element)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		elements.push_back(std::move(element));
+		changed.notify_one();
+	}
+
+	// Returns false once the queue is closed and drained, or aborted
+	bool pop(element_type &element)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		changed.wait(lock, [this](void) { return aborted || closed || !elements.empty(); });
+		if (aborted || elements.empty()) return false;
+		element = std::move(elements.front());
+		elements.pop_front();
+		return true;
+	}
+
+	void close(void)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		closed = true;
+		changed.notify_all();
+	}
+
+	void abort(void)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		aborted = true;
+		elements.clear();
+		changed.notify_all();
+	}
+
+	private:
+		std::mutex mutex;
+		std::condition_variable changed;
+		std::deque<element_type> elements;
+		bool closed = false, aborted = false;
+};
+
+// Passes transformed trees to the writer in source order.  Reserving an index blocks while capacity trees
+// are read but not yet written, which bounds the memory used by the whole pipeline.
+struct reorder_buffer
+{
+	reorder_buffer(size_t capacity) : capacity(capacity) {}
+
+	bool reserve(size_t &index)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		changed.wait(lock, [this](void) { return aborted || (issued - written < capacity); });
+		if (aborted) return false;
+		index = issued++;
+		return true;
+	}
+
+	void complete(size_t index, std::shared_ptr<luxem::value> &&tree)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		done.emplace(index, std::move(tree));
+		changed.notify_all();
+	}
+
+	bool next(std::shared_ptr<luxem::value> &tree)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		changed.wait(lock, [this](void) 
+			{ return aborted || done.count(written) || (closed && (written == issued)); });
+		auto found = done.find(written);
+		if (aborted || (found == done.end())) return false;
+		tree = std::move(found->second);
+		done.erase(found);
+		++written;
+		changed.notify_all();
+		return true;
+	}
+
+	void close(void)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		closed = true;
+		changed.notify_all();
+	}
+
+	void abort(void)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		aborted = true;
+		done.clear();
+		changed.notify_all();
+	}
+
+	private:
+		size_t const capacity;
+		std::mutex mutex;
+		std::condition_variable changed;
+		std::map<size_t, std::shared_ptr<luxem::value>> done;
+		size_t issued = 0, written = 0;
+		bool closed = false, aborted = false;
+};
+
+// Reads, transforms and writes SOURCE concurrently, with one reader thread, jobs transform threads and the 
+// writer on the calling thread.
+int run_pipeline(
+	luxemog::transform_list const &transforms,
+	bool reverse,
+	unsigned int jobs,
+	std::string const &source_filename,
+	std::string const &dest_filename,
+	io_options const &io)
+{
+	struct aborted_error {};
+
+	work_queue<std::pair<size_t, std::shared_ptr<luxem::value>>> queue;
+	reorder_buffer results(pipeline_depth);
+	std::mutex failure_mutex;
+	std::string failure;
+	auto fail = [&](std::string const &message)
+	{
+		{
+			std::lock_guard<std::mutex> lock(failure_mutex);
+			if (failure.empty()) failure = message;
+		}
+		queue.abort();
+		results.abort();
+	};
+
+	auto dest_file = open_output(dest_filename);
+	if (!dest_file)
+	{
+		std::cerr << "Failed to open output file " << dest_filename << std::endl;
+		return 1;
+	}
+	luxem::finally close_dest([&](void) { if (dest_file && (dest_file != stdout)) fclose(dest_file); });
+
+	std::thread reader_thread([&](void)
+	{
+		try
+		{
+			read_file(io.in_format, source_filename, [&](std::shared_ptr<luxem::value> &&data)
+			{
+				size_t index;
+				if (!results.reserve(index)) throw aborted_error();
+				queue.push(std::make_pair(index, std::move(data)));
+			});
+		}
+		catch (aborted_error &) {}
+		catch (std::exception &exception)
+			{ fail("Error loading SOURCE from " + source_filename + ": " + exception.what()); }
+		queue.close();
+		results.close();
+	});
+
+	std::vector<std::thread> transform_threads;
+	for (unsigned int job = 0; job < jobs; ++job) transform_threads.emplace_back([&](void)
+	{
+		try
+		{
+			std::pair<size_t, std::shared_ptr<luxem::value>> work;
+			while (queue.pop(work))
+			{
+				transforms.apply(work.second, reverse);
+				results.complete(work.first, std::move(work.second));
+			}
+		}
+		catch (std::exception &exception)
+			{ fail(std::string("Error performing transformation: ") + exception.what()); }
+	});
+
+	try
+	{
+		{
+			value_writer writer(io, dest_file);
+			std::shared_ptr<luxem::value> tree;
+			while (results.next(tree)) writer.value(*tree);
+		}
+		close_output(dest_file);
+	}
+	catch (std::exception &exception)
+	{
+		fail(
+			"Error writing to " + (dest_filename.empty() ? std::string("-") : dest_filename) + 
+			": " + exception.what());
+	}
+
+	reader_thread.join();
+	for (auto &thread : transform_threads) thread.join();
+
+	if (!failure.empty())
+	{
+		std::cerr << failure << std::endl;
+		return 1;
+	}
+	return 0;
+}
+
+// Transforms and writes each element of SOURCE's root arrays as soon as it's read, so only one element is
+// held in memory at a time.  Only valid if the transforms are streamable and both formats are luxem.  If
+// emit, the last transform's output is written as it's generated.
+int run_stream_elements(
+	luxemog::transform_list const &transforms,
+	bool reverse,
+	bool emit,
+	std::string const &source_filename,
+	std::string const &dest_filename,
+	io_options const &io)
+{
+	struct write_error : std::runtime_error { using std::runtime_error::runtime_error; };
+	struct transform_error : std::runtime_error { using std::runtime_error::runtime_error; };
+
+	auto dest_file = open_output(dest_filename);
+	if (!dest_file)
+	{
+		std::cerr << "Failed to open output file " << dest_filename << std::endl;
+		return 1;
+	}
+	luxem::finally close_dest([&](void) { if (dest_file && (dest_file != stdout)) fclose(dest_file); });
+
+	try
+	{
+		luxem::writer writer(dest_file);
+		io.configure_writer(writer);
+
+		auto apply_and_write = [&](std::shared_ptr<luxem::value> &tree, size_t const *index)
+		{
+			if (emit)
+			{
+				// Writing is interleaved with transforming, so errors can't be told apart
+				try
+				{
+					if (index) transforms.apply_element_and_write(tree, *index, writer, reverse);
+					else transforms.apply_and_write(tree, writer, reverse);
+				}
+				catch (std::exception &exception) { throw transform_error(exception.what()); }
+				return;
+			}
+			try
+			{
+				if (index) transforms.apply_element(tree, *index, reverse);
+				else transforms.apply(tree, reverse);
+			}
+			catch (std::exception &exception) { throw transform_error(exception.what()); }
+			try { writer.value(*tree); }
+			catch (std::exception &exception) { throw write_error(exception.what()); }
+		};
+
+		auto apply_whole = [&](std::shared_ptr<luxem::value> &&data) { apply_and_write(data, nullptr); };
+		auto stream_elements = [&](std::shared_ptr<luxem::value> &&data)
+		{
+			if (data->is<luxem::reader::object_context>())
+				throw std::runtime_error("A root object after a root array can't be streamed element by element.");
+			if (!data->is<luxem::reader::array_context>()) 
+			{
+				apply_and_write(data, nullptr);
+				return;
+			}
+			auto &array = data->as<luxem::reader::array_context>();
+			try
+			{
+				if (array.has_type()) writer.type(array.get_type());
+				writer.array_begin();
+			}
+			catch (std::exception &exception) { throw write_error(exception.what()); }
+			array.build_struct([&apply_and_write, index = size_t(0)](std::shared_ptr<luxem::value> &&data) mutable
+			{ 
+				apply_and_write(data, &index); 
+				++index;
+			});
+			array.finally([&](void) 
+			{
+				try { writer.array_end(); }
+				catch (std::exception &exception) { throw write_error(exception.what()); }
+			});
+		};
+
+		// Only a root array is streamed, anything else is read whole first
+		struct sniffing_reader
+		{
+			std::function<void(luxem::reader &reader, bool array)> configure;
+			root_sniffer sniffer;
+			luxem::reader reader;
+
+			size_t feed(char const *data, size_t length, bool finish)
+			{
+				if (!sniffer.decided)
+				{
+					sniffer.feed(data, length, finish);
+					if (!sniffer.decided) return 0;
+					configure(reader, sniffer.array);
+				}
+				return reader.feed(data, length, finish);
+			}
+		} reader{[&](luxem::reader &reader, bool array)
+		{
+			if (array) reader.element(stream_elements);
+			else reader.build_struct(apply_whole);
+		}};
+		feed_file(reader, source_filename);
+		try { close_output(dest_file); }
+		catch (std::exception &exception) { throw write_error(exception.what()); }
+	}
+	catch (transform_error &exception)
+	{
+		std::cerr << "Error performing transformation: " << exception.what() << std::endl;
+		return 1;
+	}
+	catch (write_error &exception)
+	{
+		std::cerr << 
+			"Error writing to " << (dest_filename.empty() ? std::string("-") : dest_filename) << 
+			": " << exception.what() << 
+			std::endl;
+		return 1;
+	}
+	catch (std::exception &exception)
+	{
+		std::cerr << "Error loading SOURCE from " << source_filename << ": " << exception.what() << std::endl;
+		return 1;
+	}
+	return 0;
+}
+
+// Loads TRANSFORMS from filename into transforms, throwing on failure
+void load_transforms(luxemog::transform_list &transforms, std::string const &filename)
+{
+	luxem::reader reader;
+	reader.element([&](std::shared_ptr<luxem::value> &&data)
+	{
+		if (!data->has_type()) throw std::runtime_error("Missing version.");
+		if (data->get_type() != "luxemog 0.0.1") 
+		{
+			std::stringstream message;
+			message << "Unknown version " << data->get_type();
+			throw std::runtime_error(message.str());
+		}
+		transforms.deserialize(std::move(data));
+	});
+
+	feed_file(reader, filename);
+}
+
+std::atomic<bool> serve_stopping{false};
+int serve_socket = -1;
+int serve_wake = -1; // Written to interrupt polling
+
+extern "C" void serve_stop(int)
+{
+	serve_stopping = true;
+	if (serve_wake >= 0) { auto ignored = write(serve_wake, "", 1); (void)ignored; }
+}
+
+// Serves requests on a Unix domain socket until interrupted.  Idle connections are polled, and each one
+// with a request waiting is queued for one of jobs worker threads, which handles that one request then
+// hands the connection back, so clients holding idle connections open don't tie up workers.  See io.h
+// for the framing.
+int run_server(
+	std::map<std::string, std::unique_ptr<luxemog::transform_list>> const &lists,
+	unsigned int jobs,
+	std::string const &socket_path,
+	bool verbose,
+	io_options const &io)
+{
+	serve_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (serve_socket < 0)
+	{
+		std::cerr << "Failed to create socket: " << strerror(errno) << std::endl;
+		return 1;
+	}
+	luxem::finally close_socket([&](void) { close(serve_socket); serve_socket = -1; });
+
+	sockaddr_un address{};
+	address.sun_family = AF_UNIX;
+	if (socket_path.size() >= sizeof(address.sun_path))
+	{
+		std::cerr << "Socket path " << socket_path << " is too long." << std::endl;
+		return 1;
+	}
+	strcpy(address.sun_path, socket_path.c_str());
+	unlink(socket_path.c_str());
+	if ((bind(serve_socket, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0) || 
+		(listen(serve_socket, SOMAXCONN) != 0))
+	{
+		std::cerr << "Failed to listen on " << socket_path << ": " << strerror(errno) << std::endl;
+		return 1;
+	}
+	luxem::finally remove_socket([&](void) { unlink(socket_path.c_str()); });
+
+	struct sigaction stop_action{};
+	stop_action.sa_handler = serve_stop;
+	sigaction(SIGINT, &stop_action, nullptr);
+	sigaction(SIGTERM, &stop_action, nullptr);
+	signal(SIGPIPE, SIG_IGN);
+
+	int wake[2];
+	if (pipe(wake) != 0)
+	{
+		std::cerr << "Failed to create pipe: " << strerror(errno) << std::endl;
+		return 1;
+	}
+	for (auto end : wake) fcntl(end, F_SETFL, O_NONBLOCK);
+	luxem::finally close_wake([&](void) { serve_wake = -1; close(wake[0]); close(wake[1]); });
+	serve_wake = wake[1];
+
+	work_queue<int> ready;
+	std::mutex open_mutex;
+	std::set<int> open;
+	std::vector<int> returned; // Handed back by workers, guarded by open_mutex
+
+	// Returns false when the connection should be closed
+	auto handle_request = [&](int connection)
+	{
+		serve_request request;
+		if (!read_request(connection, request)) return false;
+
+		bool error = false;
+		std::string body;
+		try
+		{
+			auto found = lists.find(request.name);
+			if (found == lists.end()) throw std::runtime_error("Unknown transform list '" + request.name + "'.");
+			std::vector<std::shared_ptr<luxem::value>> trees;
+			auto push = [&trees](std::shared_ptr<luxem::value> &&data) { trees.push_back(std::move(data)); };
+			if (io.in_format == format_binary)
+			{
+				luxemog::binary_reader reader;
+				reader.build_struct(push);
+				reader.feed(request.source.data(), request.source.size(), true);
+			}
+			else
+			{
+				luxem::reader reader;
+				reader.build_struct(push);
+				reader.feed(request.source.data(), request.source.size(), true);
+			}
+			for (auto &tree : trees) found->second->apply(tree, request.reverse);
+			value_writer writer(io);
+			for (auto &tree : trees) writer.value(*tree);
+			body = writer.dump();
+		}
+		catch (std::exception &exception)
+		{
+			error = true;
+			body = exception.what();
+		}
+
+		write_response(connection, error, body);
+		return true;
+	};
+
+	std::vector<std::thread> workers;
+	for (unsigned int job = 0; job < jobs; ++job) workers.emplace_back([&](void)
+	{
+		int connection;
+		while (ready.pop(connection))
+		{
+			bool keep = false;
+			try { keep = handle_request(connection); }
+			catch (std::exception &exception)
+			{
+				if (verbose) std::cerr << "Dropping connection: " << exception.what() << std::endl;
+			}
+			std::lock_guard<std::mutex> lock(open_mutex);
+			if (keep)
+			{
+				returned.push_back(connection);
+				auto ignored = write(wake[1], "", 1);
+				(void)ignored;
+			}
+			else
+			{
+				open.erase(connection);
+				close(connection);
+			}
+		}
+	});
+
+	bool failed = false;
+	std::vector<int> idle;
+	while (!serve_stopping)
+	{
+		std::vector<pollfd> polled{{serve_socket, POLLIN, 0}, {wake[0], POLLIN, 0}};
+		for (auto connection : idle) polled.push_back({connection, POLLIN, 0});
+		if (poll(polled.data(), polled.size(), -1) < 0)
+		{
+			if (errno == EINTR) continue;
+			std::cerr << "Failed to poll connections: " << strerror(errno) << std::endl;
+			failed = true;
+			break;
+		}
+
+		// Closed connections are queued too, so a worker sees the end and closes them
+		idle.clear();
+		for (size_t index = 2; index < polled.size(); ++index)
+		{
+			if (polled[index].revents) ready.push(int(polled[index].fd));
+			else idle.push_back(polled[index].fd);
+		}
+
+		if (polled[1].revents)
+		{
+			char drained[64];
+			while (read(wake[0], drained, sizeof(drained)) > 0) {}
+			std::lock_guard<std::mutex> lock(open_mutex);
+			idle.insert(idle.end(), returned.begin(), returned.end());
+			returned.clear();
+		}
+
+		if (polled[0].revents)
+		{
+			int connection = accept(serve_socket, nullptr, nullptr);
+			if (connection < 0)
+			{
+				if ((errno == EINTR) || (errno == ECONNABORTED)) continue;
+				if (serve_stopping) break;
+				std::cerr << "Failed to accept connection: " << strerror(errno) << std::endl;
+				failed = true;
+				break;
+			}
+			{
+				std::lock_guard<std::mutex> lock(open_mutex);
+				open.insert(connection);
+			}
+			idle.push_back(connection);
+		}
+	}
+
+	// Finish requests in progress, then close everything
+	ready.close();
+	{
+		std::lock_guard<std::mutex> lock(open_mutex);
+		for (auto connection : open) shutdown(connection, SHUT_RD);
+	}
+	for (auto &worker : workers) worker.join();
+	for (auto connection : open) close(connection);
+	return failed ? 1 : 0;
+}
+
 int main(int argc, char **argv)
 {
 	bool verbose = false;
@@ -12,7 +625,18 @@ int main(int argc, char **argv)
 	bool minimize = false;
 	bool use_spaces = false;
 	int indent_count = 1;
-	std::string transforms_filename, source_filename, dest_filename;
+	unsigned int jobs = 0;
+	size_t cache = 0;
+	bool share_output = false;
+	bool stream_elements = false;
+	bool summarize = false;
+	bool optimize = false;
+	bool emit = false;
+	std::string profile_filename, profile_attempts_filename;
+	io_options io;
+	luxemog::traversal_order traversal = luxemog::traverse_reenter;
+	std::string transforms_filename, source_filename, dest_filename, serve_path;
+	std::vector<std::string> serve_lists;
 
 	{
 		option long_options[] = {
@@ -23,17 +647,31 @@ int main(int argc, char **argv)
 			{"minimize", no_argument, 0, 'm'},
 			{"use-spaces", no_argument, 0, 's'},
 			{"indent-count", required_argument, 0, 'i'},
+			{"jobs", required_argument, 0, 'j'},
+			{"traversal", required_argument, 0, 't'},
+			{"cache", required_argument, 0, 'c'},
+			{"share-output", no_argument, 0, 'S'},
+			{"serve", required_argument, 0, 'd'},
+			{"stream-elements", no_argument, 0, 'E'},
+			{"in-format", required_argument, 0, 'f'},
+			{"out-format", required_argument, 0, 'F'},
+			{"summarize", no_argument, 0, 'u'},
+			{"profile", required_argument, 0, 'p'},
+			{"profile-attempts", required_argument, 0, 'P'},
+			{"optimize", no_argument, 0, 'O'},
+			{"emit", no_argument, 0, 'e'},
 			{0, 0, 0, 0}
 		};
 
 		int next;
-		while ((next = getopt_long(argc, argv, "hvo:rmsi:", long_options, nullptr)) != -1) 
+		while ((next = getopt_long(argc, argv, "hvo:rmsi:j:t:c:Sd:Ef:F:up:P:Oe", long_options, nullptr)) != -1) 
 		{
 			switch (next) 
 			{
 				case 'h': 
 					std::cout << 
 "usage: luxemog OPTIONS TRANSFORMS SOURCE\n"
+"       luxemog OPTIONS --serve SOCKET [NAME=]TRANSFORMS ...\n"
 "\n"
 "    OPTIONS can be any combination or none of the following:\n"
 "      -h, --help                      Show this message.\n"
@@ -47,6 +685,57 @@ int main(int argc, char **argv)
 "                                      output\n"
 "      -i COUNT, --indent-count COUNT  Use COUNT spaces or tabs to indent\n"
 "                                      pretty output\n"
+"      -j COUNT, --jobs COUNT          Read, transform and write concurrently,\n"
+"                                      using COUNT transform threads.\n"
+"      -t ORDER, --traversal ORDER     Use ORDER for transforms that don't\n"
+"                                      specify a traversal.  ORDER is one of\n"
+"                                      reenter (default), no_reenter or\n"
+"                                      bottom_up.\n"
+"      -c COUNT, --cache COUNT         Remember the results of transforming up\n"
+"                                      to COUNT repeated subtrees and reuse\n"
+"                                      them for identical subtrees.\n"
+"      -S, --share-output              Make identical generated subtrees share\n"
+"                                      one instance to save memory.\n"
+"      -d SOCKET, --serve SOCKET       Keep the TRANSFORMS files loaded and\n"
+"                                      serve requests on the Unix domain\n"
+"                                      socket SOCKET until interrupted, using\n"
+"                                      --jobs threads (default: one per CPU).\n"
+"                                      Each file is named NAME, or its\n"
+"                                      filename if NAME= is omitted.\n"
+"      -E, --stream-elements           Transform and write each element of a\n"
+"                                      root array as soon as it's read rather\n"
+"                                      than reading the whole array first.\n"
+"                                      Fails if any transform could match the\n"
+"                                      array itself.  Other roots are read\n"
+"                                      whole as usual.\n"
+"      -f FORMAT, --in-format FORMAT   Read SOURCE as FORMAT, luxem (default)\n"
+"                                      or binary.\n"
+"      -F FORMAT, --out-format FORMAT  Write the result as FORMAT, luxem\n"
+"                                      (default) or binary.  Binary is\n"
+"                                      faster to read and write and smaller,\n"
+"                                      for passing data between luxemog runs.\n"
+"      -u, --summarize                 Summarize the contents of each subtree\n"
+"                                      first, then skip subtrees that can't\n"
+"                                      contain a match.  Faster when\n"
+"                                      transforms only match rare keys,\n"
+"                                      types or values.\n"
+"      -p FILE, --profile FILE         Write the time spent scanning each\n"
+"                                      pattern node to FILE as folded stacks\n"
+"                                      in nanoseconds, for flame graph tools.\n"
+"      -P FILE, --profile-attempts FILE\n"
+"                                      Write the number of times each pattern\n"
+"                                      node was scanned to FILE as folded\n"
+"                                      stacks.\n"
+"      -O, --optimize                  Simplify the transforms after loading,\n"
+"                                      dropping ones that can't change\n"
+"                                      anything.  With --verbose, report each\n"
+"                                      change.\n"
+"      -e, --emit                      Write the last transform's output as\n"
+"                                      it's generated rather than building\n"
+"                                      it first, saving the memory it would\n"
+"                                      take.  Output may be partly written\n"
+"                                      if transforming fails.  Only for luxem\n"
+"                                      output, without --jobs.\n"
 "\n"
 "    TRANSFORMS\n"
 "      A filename.\n"
@@ -54,7 +743,14 @@ int main(int argc, char **argv)
 "    SOURCE\n"
 "      A filename or '-' for stdin.\n"
 "\n"
-"Transforms SOURCE based on the transformations in the TRANSFORMS file.\n" << std::endl;
+"Transforms SOURCE based on the transformations in the TRANSFORMS file.\n"
+"\n"
+"When serving, a client sends any number of requests on a connection, each:\n"
+"    u32 name length, name, u8 1 to reverse or 0, u32 SOURCE length, SOURCE\n"
+"and receives a response to each:\n"
+"    u8 0 on success or 1 on error, u32 length, result or error message\n"
+"with lengths in network byte order.  Format and output options apply to\n"
+"SOURCE and the results.\n" << std::endl;
 					return 0;
 				case 'v': verbose = true; break;
 				case 'o': dest_filename = optarg; break;
@@ -62,49 +758,139 @@ int main(int argc, char **argv)
 				case 'm': minimize = true; break;
 				case 's': use_spaces = true; break;
 				case 'i': indent_count = atoi(optarg); break;
+				case 'j': jobs = std::max(atoi(optarg), 1); break;
+				case 'c': cache = std::max(atoi(optarg), 0); break;
+				case 'S': share_output = true; break;
+				case 'd': serve_path = optarg; break;
+				case 'E': stream_elements = true; break;
+				case 'u': summarize = true; break;
+				case 'p': profile_filename = optarg; break;
+				case 'P': profile_attempts_filename = optarg; break;
+				case 'O': optimize = true; break;
+				case 'e': emit = true; break;
+				case 'f':
+				case 'F':
+				{
+					std::string name(optarg);
+					data_format format;
+					if (name == "luxem") format = format_luxem;
+					else if (name == "binary") format = format_binary;
+					else
+					{
+						std::cerr << "Unknown format " << name << std::endl;
+						return 1;
+					}
+					(next == 'f' ? io.in_format : io.out_format) = format;
+				} break;
+				case 't':
+				{
+					std::string name(optarg);
+					if (name == "reenter") traversal = luxemog::traverse_reenter;
+					else if (name == "no_reenter") traversal = luxemog::traverse_no_reenter;
+					else if (name == "bottom_up") traversal = luxemog::traverse_bottom_up;
+					else
+					{
+						std::cerr << "Unknown traversal " << name << std::endl;
+						return 1;
+					}
+				} break;
 				case '?': return 1;
 			}
 		}
 
-		if (argc - optind < 2)
+		if (!serve_path.empty())
 		{
-			std::cerr << "Missing one or more of: TRANSFORMS, SOURCE" << std::endl;
-			return 1;
+			if (argc - optind < 1)
+			{
+				std::cerr << "Missing TRANSFORMS" << std::endl;
+				return 1;
+			}
+			while (optind < argc) serve_lists.push_back(argv[optind++]);
 		}
+		else
+		{
+			if (argc - optind < 2)
+			{
+				std::cerr << "Missing one or more of: TRANSFORMS, SOURCE" << std::endl;
+				return 1;
+			}
 
-		transforms_filename = argv[optind++];
-		source_filename = argv[optind++];
+			transforms_filename = argv[optind++];
+			source_filename = argv[optind++];
+		}
 	}
 
-	luxemog::transform_list transforms(verbose);
+	io.configure_writer = [&](luxem::writer &writer)
+	{
+		if (!minimize)
+			writer.set_pretty(use_spaces ? ' ' : '\t', indent_count);
+	};
 
-	try
+	if (!serve_path.empty())
 	{
-		luxem::reader reader;
-		reader.element([&](std::shared_ptr<luxem::value> &&data)
+		if (!profile_filename.empty() || !profile_attempts_filename.empty())
 		{
-			if (!data->has_type()) throw std::runtime_error("Missing version.");
-			if (data->get_type() != "luxemog 0.0.1") 
-			{
-				std::stringstream message;
-				message << "Unknown version " << data->get_type();
-				throw std::runtime_error(message.str());
-			}
-			transforms.deserialize(std::move(data));
-		});
-
-		auto transform_file = fopen(transforms_filename.c_str(), "rb");
-			
-		if (!transform_file)
+			std::cerr << "--profile can't be combined with --serve" << std::endl;
+			return 1;
+		}
+		if (emit)
 		{
-			std::cerr << "Failed to open TRANSFORMS file " << transforms_filename << std::endl;
+			std::cerr << "--emit can't be combined with --serve" << std::endl;
 			return 1;
 		}
-
+		std::map<std::string, std::unique_ptr<luxemog::transform_list>> lists;
+		for (auto &argument : serve_lists)
 		{
-			luxem::finally finally([&](void) { fclose(transform_file); });
-			reader.feed(transform_file);
+			auto split = argument.find('=');
+			auto name = split == std::string::npos ? argument : argument.substr(0, split);
+			auto filename = split == std::string::npos ? argument : argument.substr(split + 1);
+			auto &transforms = lists[name];
+			transforms = std::make_unique<luxemog::transform_list>(verbose, traversal);
+			transforms->set_memo_capacity(cache);
+			transforms->set_share_output(share_output);
+			transforms->set_subtree_summaries(summarize);
+			try 
+			{ 
+				load_transforms(*transforms, filename); 
+				if (optimize) transforms->optimize();
+
+				// Requests choose the direction, so only fail if neither works.  Requests in a direction that
+				// doesn't work get its error.
+				std::string errors[2];
+				for (bool direction : {false, true})
+				{
+					try { transforms->validate(direction); }
+					catch (std::exception &exception) { errors[direction] = exception.what(); }
+				}
+				if (!errors[false].empty() && !errors[true].empty()) throw std::runtime_error(errors[false]);
+				for (bool direction : {false, true})
+				{
+					if (verbose && !errors[direction].empty())
+						std::cerr << "TRANSFORMS from " << filename << " can't be applied" << 
+							(direction ? " reversed: " : ": ") << errors[direction] << std::endl;
+				}
+			}
+			catch (std::exception &exception)
+			{
+				std::cerr << "Error loading TRANSFORMS from " << filename << ": " << exception.what() << std::endl;
+				return 1;
+			}
 		}
+		if (jobs == 0) jobs = std::max(std::thread::hardware_concurrency(), 1u);
+		return run_server(lists, jobs, serve_path, verbose, io);
+	}
+
+	luxemog::transform_list transforms(verbose, traversal);
+	transforms.set_memo_capacity(cache);
+	transforms.set_share_output(share_output);
+	transforms.set_subtree_summaries(summarize);
+	transforms.set_profiling(!profile_filename.empty() || !profile_attempts_filename.empty());
+
+	try
+	{
+		load_transforms(transforms, transforms_filename);
+		if (optimize) transforms.optimize();
+		transforms.validate(reverse);
 	}
 	catch (std::exception &exception)
 	{
@@ -112,26 +898,83 @@ int main(int argc, char **argv)
 		return 1;
 	}
 
-	std::vector<std::shared_ptr<luxem::value>> trees;
+	// Also written if transforming fails, to show where the time went
+	luxem::finally write_profiles([&](void)
+	{
+		for (auto attempts : {false, true})
+		{
+			auto &filename = attempts ? profile_attempts_filename : profile_filename;
+			if (filename.empty()) continue;
+			std::ofstream out(filename);
+			transforms.write_profile(out, attempts);
+			if (!out) std::cerr << "Failed to write profile to " << filename << std::endl;
+		}
+	});
 
-	try
+	// Reports on the run once everything is written
+	auto finish = [&](void)
 	{
-		if (source_filename == "-") { trees = luxem::read_struct(stdin); }
-		else
+		if (verbose)
 		{
-			auto source_file = fopen(source_filename.c_str(), "rb");
-			
-			if (!source_file)
-			{
-				std::cerr << "Failed to open SOURCE file " << source_filename << std::endl;
-				return 1;
-			}
+			auto stats = luxemog::get_regex_pool_stats();
+			std::cerr << "Compiled " << stats.compiled << " of " << stats.entries << " regexes in " << 
+				stats.compile_seconds << "s" << std::endl;
+		}
+		return 0;
+	};
 
-			{
-				luxem::finally finally([&](void) { fclose(source_file); });
-				trees = luxem::read_struct(source_file);
-			}
+	if (emit)
+	{
+		if (jobs > 0)
+		{
+			std::cerr << "--emit can't be combined with --jobs" << std::endl;
+			return 1;
+		}
+		if (io.out_format != format_luxem)
+		{
+			std::cerr << "--emit only supports the luxem format" << std::endl;
+			return 1;
+		}
+		if (verbose && !transforms.emittable(reverse))
+			std::cerr << "The last transform can't be emitted, so its output will be built first" << std::endl;
+	}
+
+	if (stream_elements)
+	{
+		if (jobs > 0)
+		{
+			std::cerr << "--stream-elements can't be combined with --jobs" << std::endl;
+			return 1;
+		}
+		if ((io.in_format != format_luxem) || (io.out_format != format_luxem))
+		{
+			std::cerr << "--stream-elements only supports the luxem format" << std::endl;
+			return 1;
+		}
+		if (!transforms.streamable(reverse))
+		{
+			std::cerr << 
+				"Can't stream elements: a transform in " << transforms_filename << 
+				" may match a root array.  Add a scope or make the " << (reverse ? "'to'" : "'from'") << 
+				" pattern unable to match arrays." << std::endl;
+			return 1;
 		}
+		if (run_stream_elements(transforms, reverse, emit, source_filename, dest_filename, io)) return 1;
+		return finish();
+	}
+
+	if (jobs > 0)
+	{
+		if (run_pipeline(transforms, reverse, jobs, source_filename, dest_filename, io)) return 1;
+		return finish();
+	}
+
+	std::vector<std::shared_ptr<luxem::value>> trees;
+
+	try
+	{
+		read_file(io.in_format, source_filename, [&trees](std::shared_ptr<luxem::value> &&data) 
+			{ trees.push_back(std::move(data)); });
 	}
 	catch (std::exception &exception)
 	{
@@ -139,6 +982,39 @@ int main(int argc, char **argv)
 		return 1;
 	}
 
+
+	if (emit)
+	{
+		auto dest_file = open_output(dest_filename);
+		if (!dest_file)
+		{
+			std::cerr << "Failed to open output file " << dest_filename << std::endl;
+			return 1;
+		}
+		luxem::finally close_dest([&](void) { if (dest_file && (dest_file != stdout)) fclose(dest_file); });
+		try
+		{
+			luxem::writer writer(dest_file);
+			io.configure_writer(writer);
+			for (auto &tree : trees) transforms.apply_and_write(tree, writer, reverse);
+		}
+		catch (std::exception &exception)
+		{
+			std::cerr << "Error performing transformation: " << exception.what() << std::endl;
+			return 1;
+		}
+		try { close_output(dest_file); }
+		catch (std::exception &exception)
+		{
+			std::cerr << 
+				"Error writing to " << (dest_filename.empty() ? std::string("-") : dest_filename) << 
+				": " << exception.what() << 
+				std::endl;
+			return 1;
+		}
+		return finish();
+	}
+
 	try
 	{
 		for (auto &tree : trees) 
@@ -152,32 +1028,20 @@ int main(int argc, char **argv)
 
 	try
 	{
-		auto write = [&](luxem::writer &&writer)
-		{
-			if (!minimize)
-				writer.set_pretty(use_spaces ? ' ' : '\t', indent_count);
-			for (auto &tree : trees) writer.value(*tree);
-		};
+		auto dest_file = open_output(dest_filename);
 
-		if (dest_filename.empty() || dest_filename == "-")
+		if (!dest_file)
 		{
-			write({stdout});
+			std::cerr << "Failed to open output file " << dest_filename << std::endl;
+			return 1;
 		}
-		else
-		{
-			auto dest_file = fopen(dest_filename.c_str(), "rb");
 
-			if (!dest_file)
-			{
-				std::cerr << "Failed to open output file " << dest_filename << std::endl;
-				return 1;
-			}
-
-			{
-				luxem::finally finally([&](void) { fclose(dest_file); });
-				write({dest_file});
-			}
+		luxem::finally finally([&](void) { if (dest_file && (dest_file != stdout)) fclose(dest_file); });
+		{
+			value_writer writer(io, dest_file);
+			for (auto &tree : trees) writer.value(*tree);
 		}
+		close_output(dest_file);
 	}
 	catch (std::exception &exception)
 	{
@@ -188,5 +1052,5 @@ int main(int argc, char **argv)
 		return 1;
 	}
 
-	return 0;
+	return finish();
 }
@@ -1,7 +1,7 @@
 Luxemog = Define.Library
 {
 	Name = 'luxemog',
-	Sources = Item 'luxemog.cxx',
+	Sources = Item 'luxemog.cxx' + 'binary.cxx',
 	LinkFlags = ' -lluxem-cxx'
 }
 
@@ -0,0 +1,274 @@
+#include "luxemog.h"
+
+#include <sstream>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+
+// Stream: the magic, then any number of root values.
+// Value: a tag byte (kind in the low 2 bits, 4 if typed), the type's string reference if typed, then
+//   primitive: varint length, bytes
+//   object: varint count, count * (key string reference, value)
+//   array: varint count, count * value
+// String reference: varint 0 followed by varint length and bytes for a new string, or 1 + the index of a
+// string in the table.  New strings up to binary_table_string_limit bytes are appended to the table, until
+// it holds binary_table_limit strings.  The table lasts for the whole stream.
+// Varints are little endian base 128.
+
+char const binary_magic[] = {'l', 'x', 'b', '1'};
+size_t const binary_table_limit = 1 << 16;
+size_t const binary_table_string_limit = 256;
+size_t const binary_depth_limit = 1 << 16;
+
+enum binary_kind : uint8_t
+{
+	binary_primitive = 0,
+	binary_object = 1,
+	binary_array = 2,
+	binary_typed = 4
+};
+
+namespace luxemog
+{
+
+binary_writer::binary_writer(void) {}
+
+binary_writer::binary_writer(FILE *file) : file(file) {}
+
+binary_writer::binary_writer(std::function<void(char const *data, size_t length)> &&callback) :
+	callback(std::move(callback)) {}
+
+binary_writer &binary_writer::value(luxem::value const &data)
+{
+	if (!started)
+	{
+		buffer.append(binary_magic, sizeof(binary_magic));
+		started = true;
+	}
+	write_value(data);
+	if (file)
+	{
+		if (fwrite(buffer.data(), 1, buffer.size(), file) != buffer.size())
+			throw std::runtime_error(std::string("Failed to write: ") + strerror(errno));
+		buffer.clear();
+	}
+	else if (callback)
+	{
+		callback(buffer.data(), buffer.size());
+		buffer.clear();
+	}
+	return *this;
+}
+
+std::string binary_writer::dump(void) { return buffer; }
+
+void binary_writer::write_varint(uint64_t value)
+{
+	while (value >= 0x80)
+	{
+		buffer.push_back(static_cast<char>((value & 0x7F) | 0x80));
+		value >>= 7;
+	}
+	buffer.push_back(static_cast<char>(value));
+}
+
+void binary_writer::write_string(std::string const &text)
+{
+	auto found = table.find(text);
+	if (found != table.end())
+	{
+		write_varint(found->second + 1);
+		return;
+	}
+	write_varint(0);
+	write_varint(text.size());
+	buffer.append(text);
+	if ((text.size() <= binary_table_string_limit) && (table.size() < binary_table_limit))
+		table.emplace(text, table.size());
+}
+
+void binary_writer::write_value(luxem::value const &data)
+{
+	uint8_t tag = data.has_type() ? binary_typed : 0;
+	if (data.is<luxem::primitive>())
+	{
+		buffer.push_back(static_cast<char>(tag | binary_primitive));
+		if (data.has_type()) write_string(data.get_type());
+		auto &text = data.as<luxem::primitive>().get_primitive();
+		write_varint(text.size());
+		buffer.append(text);
+	}
+	else if (data.is<luxem::object>())
+	{
+		buffer.push_back(static_cast<char>(tag | binary_object));
+		if (data.has_type()) write_string(data.get_type());
+		auto &children = data.as<luxem::object>().get_data();
+		write_varint(children.size());
+		for (auto &child : children)
+		{
+			write_string(child.first);
+			write_value(*child.second);
+		}
+	}
+	else if (data.is<luxem::array>())
+	{
+		buffer.push_back(static_cast<char>(tag | binary_array));
+		if (data.has_type()) write_string(data.get_type());
+		auto &children = data.as<luxem::array>().get_data();
+		write_varint(children.size());
+		for (auto &child : children) write_value(*child);
+	}
+	else
+	{
+		std::stringstream message;
+		message << "Cannot write " << data.get_name() << " as binary luxem.";
+		throw std::runtime_error(message.str());
+	}
+}
+
+binary_reader &binary_reader::build_struct(std::function<void(std::shared_ptr<luxem::value> &&data)> &&callback)
+{
+	this->callback = std::move(callback);
+	return *this;
+}
+
+size_t binary_reader::feed(std::string const &data, bool finish)
+	{ return feed(data.data(), data.size(), finish); }
+
+// Thrown when an element continues past the fed data
+struct binary_incomplete {};
+
+size_t binary_reader::feed(char const *data, size_t length, bool finish)
+{
+	char const *position = data;
+	char const *end = data + length;
+
+	if (!started)
+	{
+		if (length < sizeof(binary_magic))
+		{
+			if (finish && (length > 0)) throw std::runtime_error("Truncated binary luxem.");
+			return 0;
+		}
+		if (memcmp(data, binary_magic, sizeof(binary_magic)) != 0)
+			throw std::runtime_error("Not binary luxem: bad magic.");
+		position += sizeof(binary_magic);
+		started = true;
+	}
+
+	// Reads whole elements, keeping the containers of a partly read root value for the next feed, so a large
+	// value arriving in pieces is only read once
+	while (position != end)
+	{
+		auto const table_size = table.size();
+		auto element_start = position;
+		try { read_element(position, end); }
+		catch (binary_incomplete &)
+		{
+			table.resize(table_size);
+			if (finish) throw std::runtime_error("Truncated binary luxem.");
+			return element_start - data;
+		}
+		if (stack.empty() && callback) callback(std::move(root));
+	}
+	if (finish && !stack.empty()) throw std::runtime_error("Truncated binary luxem.");
+	return length;
+}
+
+uint64_t binary_reader::read_varint(char const *&position, char const *end)
+{
+	uint64_t out = 0;
+	for (unsigned int shift = 0; ; shift += 7)
+	{
+		if (position == end) throw binary_incomplete();
+		if (shift > 63) throw std::runtime_error("Invalid binary luxem: varint too long.");
+		uint8_t next = *position++;
+		out |= uint64_t(next & 0x7F) << shift;
+		if (!(next & 0x80)) return out;
+	}
+}
+
+std::string binary_reader::read_bytes(char const *&position, char const *end)
+{
+	auto size = read_varint(position, end);
+	if (size > uint64_t(end - position)) throw binary_incomplete();
+	std::string out(position, size);
+	position += size;
+	return out;
+}
+
+std::string binary_reader::read_string(char const *&position, char const *end)
+{
+	auto reference = read_varint(position, end);
+	if (reference == 0)
+	{
+		auto out = read_bytes(position, end);
+		if ((out.size() <= binary_table_string_limit) && (table.size() < binary_table_limit))
+			table.push_back(out);
+		return out;
+	}
+	if (reference > table.size())
+	{
+		std::stringstream message;
+		message << "Invalid binary luxem: string reference " << reference << " past table end " <<
+			table.size() << ".";
+		throw std::runtime_error(message.str());
+	}
+	return table[reference - 1];
+}
+
+// Reads one value, with its key if its parent is an object, and adds it to the root value being read.  Nothing
+// changes if the element is incomplete.  Containers are read iteratively so deeply nested input can't overflow
+// the stack.
+void binary_reader::read_element(char const *&position, char const *end)
+{
+	std::string key;
+	if (!stack.empty() && stack.back().container->is<luxem::object>()) key = read_string(position, end);
+
+	if (position == end) throw binary_incomplete();
+	uint8_t tag = *position++;
+	std::string type;
+	if (tag & binary_typed) type = read_string(position, end);
+
+	std::shared_ptr<luxem::value> next;
+	uint64_t count = 0;
+	switch (tag & ~binary_typed)
+	{
+		case binary_primitive: next = std::make_shared<luxem::primitive>(read_bytes(position, end)); break;
+		case binary_object: next = std::make_shared<luxem::object>(); count = read_varint(position, end); break;
+		case binary_array:
+			next = std::make_shared<luxem::array>();
+			count = read_varint(position, end);
+			// Each element takes at least a byte
+			next->as<luxem::array>().get_data().reserve(std::min<uint64_t>(count, end - position));
+			break;
+		default:
+		{
+			std::stringstream message;
+			message << "Invalid binary luxem: unknown tag " << static_cast<unsigned int>(tag) << ".";
+			throw std::runtime_error(message.str());
+		}
+	}
+	if (tag & binary_typed) next->set_type(std::move(type));
+
+	auto container = next.get();
+	if (stack.empty()) root = std::move(next);
+	else
+	{
+		auto &parent = stack.back();
+		if (parent.container->is<luxem::object>())
+			parent.container->as<luxem::object>().get_data()[std::move(key)] = std::move(next);
+		else parent.container->as<luxem::array>().get_data().push_back(std::move(next));
+		--parent.remaining;
+	}
+
+	if (count > 0)
+	{
+		if (stack.size() >= binary_depth_limit)
+			throw std::runtime_error("Invalid binary luxem: nested too deeply.");
+		stack.push_back(frame{container, count});
+	}
+	while (!stack.empty() && (stack.back().remaining == 0)) stack.pop_back();
+}
+
+}
@@ -3,11 +3,46 @@
 #include <sstream>
 #include <iostream>
 #include <regex>
+#include <atomic>
+#include <mutex>
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+#include <chrono>
+#include <limits>
+#include <type_traits>
+
+// Interned strings.  Equal strings share one symbol, so symbols compare by address.
+typedef std::string const *symbol;
+
+symbol intern(std::string const &text)
+{
+	static std::mutex mutex;
+	static std::unordered_set<std::string> table;
+	std::lock_guard<std::mutex> lock(mutex);
+	return &*table.insert(text).first;
+}
+
+// A string saved by a regex.  Captures point into the matched tree, which outlives the match_map; only
+// substitution results are owned.
+struct saved_string
+{
+	std::shared_ptr<std::string const> owned;
+	char const *data;
+	size_t size;
+
+	saved_string(char const *data, size_t size) : data(data), size(size) {}
+	saved_string(std::string &&text) : 
+		owned(std::make_shared<std::string const>(std::move(text))), 
+		data(owned->data()), 
+		size(owned->size()) 
+		{}
+};
 
 struct match_map
 {
-	std::map<std::string, std::shared_ptr<luxem::value>> trees;
-	std::map<std::string, std::string> strings;
+	std::map<symbol, std::shared_ptr<luxem::value>> trees;
+	std::map<symbol, saved_string> strings;
 
 	void update(match_map &other)
 	{
@@ -38,17 +73,102 @@ struct function_scan_stackable : scan_stackable
 		{ return callback(context, last_result); }
 };
 
+// Two independent 64-bit hashes of a tree's structure and contents, and its size, wide enough that equal
+// digests are taken to mean identical trees
+struct tree_digest
+{
+	uint64_t first, second;
+	size_t nodes;
+
+	bool operator ==(tree_digest const &other) const
+		{ return first == other.first && second == other.second && nodes == other.nodes; }
+};
+
+struct subtree_hash
+{
+	tree_digest digest;
+	std::shared_ptr<luxem::value> keepalive; // So the address can't be reused while hashed
+};
+
+typedef std::unordered_map<luxem::value const *, subtree_hash> subtree_hashes;
+
+// Bloom-style sets of the types, keys and primitives in a tree
+struct feature_set
+{
+	uint64_t structure = 0; // Types and keys
+	uint64_t literals = 0; // Primitives
+
+	bool contains(feature_set const &other) const
+	{
+		return ((structure & other.structure) == other.structure) && 
+			((literals & other.literals) == other.literals);
+	}
+	feature_set &operator |=(feature_set const &other)
+	{
+		structure |= other.structure;
+		literals |= other.literals;
+		return *this;
+	}
+	feature_set &operator &=(feature_set const &other)
+	{
+		structure &= other.structure;
+		literals &= other.literals;
+		return *this;
+	}
+};
+
+struct subtree_summary
+{
+	feature_set features;
+	std::shared_ptr<luxem::value> keepalive; // So the address can't be reused while summarized
+};
+
+// The patterns for one direction of a transform, specialized for their roles when loading finishes
+struct luxemog::transform::transform_data::program
+{
+	std::shared_ptr<luxem::value> match, generate;
+	feature_set required; // Features every tree matching match has
+	bool may_match_array = true; // If match may match an array, at the root
+	std::string error; // Why this direction can't be applied, including by subtransforms; empty if it can
+	std::vector<std::vector<luxemog::transform::transform_data const *>> stages; // Subtransforms, in order, with
+		// consecutive ones that can share one traversal grouped together
+	bool dead = false; // Dropped by the optimizer, since it can't change anything
+};
+
+struct profile_frame
+{
+	luxem::value const *pattern;
+	std::chrono::steady_clock::time_point start;
+	uint64_t child_nanoseconds;
+};
+
+struct profile_sample
+{
+	uint64_t nanoseconds = 0;
+	uint64_t attempts = 0;
+};
+
 struct scan_context
 {
 	bool verbose;
 	bool reverse;
-	std::list<luxemog::transform::transform_data *> transform_stack;
+	std::list<luxemog::transform::transform_data const *> transform_stack;
 	std::list<std::unique_ptr<scan_stackable>> stack;
 
-	std::shared_ptr<luxem::value> &get_from(void) 
-		{ return reverse ? transform_stack.back()->to : transform_stack.back()->from; }
-	std::shared_ptr<luxem::value> &get_to(void)
-		{ return reverse ? transform_stack.back()->from : transform_stack.back()->to; }
+	luxemog::transform_memo *memo = nullptr;
+	subtree_hashes *hashes = nullptr; // Of the target, made once per apply
+	luxemog::output_pool *pool = nullptr;
+	std::shared_ptr<void> pool_scan; // From pool->begin_scan
+	size_t replacements = 0;
+
+	luxemog::subtree_summaries *summaries = nullptr;
+
+	luxemog::transform_profile *profile = nullptr;
+	std::vector<profile_frame> profile_frames; // One per pattern node being scanned
+	std::map<std::vector<void const *>, profile_sample> profile_samples; // Merged into profile after applying
+
+	luxemog::transform::transform_data::program const &get_program(void)
+		{ return *transform_stack.back()->programs[reverse]; }
 };
 
 struct transform_context;
@@ -84,6 +204,7 @@ void transform_root(
 
 struct build_context;
 void build_preprocess(build_context &context, std::shared_ptr<luxem::value> &data);
+void build_finally(build_context &context, std::function<void(void)> &&callback);
 
 ///////////////////////////////////////////////////////////////////////////////
 // special nodes
@@ -93,25 +214,38 @@ struct special : luxem::value
 	static std::string const name;
 
 	virtual ~special(void) {}
-	virtual step_result scan(scan_context &context, match_map &matches, std::shared_ptr<luxem::value> &target) = 0;
-	virtual std::shared_ptr<luxem::value> generate(transform_context &context, match_map const &matches) = 0;
+	virtual step_result scan(scan_context &context, match_map &matches, std::shared_ptr<luxem::value> &target) const = 0;
+	virtual std::shared_ptr<luxem::value> generate(transform_context &context, match_map const &matches) const = 0;
 };
 
 std::string const special::name("special");
 
-std::string format_string(std::string const &pattern, match_map const &matches)
+// A string with <id> references to saved strings, parsed once at load
+struct format_pattern
 {
-	auto parse = [&pattern](auto callback)
+	struct chunk
+	{
+		bool literal;
+		std::string text;
+		symbol id;
+	};
+	std::vector<chunk> chunks;
+
+	format_pattern(void) {}
+	format_pattern(std::string const &pattern)
 	{
 		size_t offset = 0;
-		char const *run_start = &pattern[0];
-		size_t run_length = 0;
+		size_t run_start = 0;
 		bool literal = true;
-		auto end = [&](void)
+		auto end = [&](size_t run_end)
 		{
-			callback(run_start, run_length, literal);
-			run_start = &pattern[offset];
-			run_length = 0;
+			if (literal) 
+			{
+				if (run_end > run_start) 
+					chunks.push_back(chunk{true, pattern.substr(run_start, run_end - run_start), nullptr});
+			}
+			else chunks.push_back(chunk{false, {}, intern(pattern.substr(run_start, run_end - run_start))});
+			run_start = offset;
 		};
 		bool escape = false;
 		while (offset < pattern.size())
@@ -119,84 +253,76 @@ std::string format_string(std::string const &pattern, match_map const &matches)
 			auto const next = pattern[offset++];
 			if (literal && !escape && (next == '<'))
 			{
-				end();
+				end(offset - 1);
 				literal = false;
 			}
 			else if (!literal && (next == '>'))
 			{
-				end();
+				end(offset - 1);
 				literal = true;
 			}
 			else if (literal && !escape && (next == '%'))
 			{
-				end();
+				end(offset - 1);
 				escape = true;
 			}
-			else
-			{
-				run_length += 1;
-				escape = false;
-			}
+			else escape = false;
 		}
-		end();
-	};
-
-	size_t expected_length = 0;
-	std::list<std::string const *> references;
+		end(offset);
+	}
 
-	parse([&](char const *chunk, size_t chunk_length, bool literal)
+	std::string format(match_map const &matches) const
 	{
-		if (literal) expected_length += chunk_length;
-		else
+		size_t expected_length = 0;
+		std::vector<saved_string const *> references;
+		references.reserve(chunks.size());
+		for (auto &chunk : chunks)
 		{
-			std::string key(chunk, chunk_length);
-			auto found = matches.strings.find(key);
+			if (chunk.literal) 
+			{
+				expected_length += chunk.text.size();
+				continue;
+			}
+			auto found = matches.strings.find(chunk.id);
 			if (found == matches.strings.end()) 
 			{
 				std::stringstream message;
-				message << "Missing saved value for key '" << key << "'.";
+				message << "Missing saved value for key '" << *chunk.id << "'.";
 				throw std::runtime_error(message.str());
 			}
-			expected_length += found->second.size();
+			expected_length += found->second.size;
 			references.push_back(&found->second);
 		}
-	});
 
-	{
-		std::vector<char> out;
-		out.resize(expected_length);
-		auto ref_iterator = references.begin();
-		size_t offset = 0;
-		parse([&](char const *chunk, size_t chunk_length, bool literal)
+		std::string out;
+		out.reserve(expected_length);
+		auto reference = references.begin();
+		for (auto &chunk : chunks)
 		{
-			if (literal) 
-			{
-				memcpy(&out[offset], chunk, chunk_length);
-				offset += chunk_length;
-			}
-			else
+			if (chunk.literal) out += chunk.text;
+			else 
 			{
-				memcpy(&out[offset], (*ref_iterator)->c_str(), (*ref_iterator)->size());
-				offset += (*ref_iterator)->size();
+				out.append((*reference)->data, (*reference)->size);
+				++reference;
 			}
-		});
-		return std::string(&out[0], out.size());
+		}
+		return out;
 	}
-}
+};
 
 struct build_type : special
 {
 	static std::string const name;
 	std::string const &get_name(void) const override { return name; }
 
-	std::string format;
+	format_pattern format;
 	std::shared_ptr<luxem::value> value;
 
 	build_type(build_context &context, std::shared_ptr<luxem::value> &&data)
 	{ 
 		auto &object = data->as<luxem::reader::object_context>();
 		object.element("type", [this](std::shared_ptr<luxem::value> &&data) 
-			{ format = data->as<luxem::primitive>().get_string(); });
+			{ format = format_pattern(data->as<luxem::primitive>().get_string()); });
 		object.build_struct(
 			"value", 
 			[this](std::shared_ptr<luxem::value> &&data) 
@@ -205,13 +331,13 @@ struct build_type : special
 				{ build_preprocess(context, data); });
 	}
 
-	step_result scan(scan_context &context, match_map &matches, std::shared_ptr<luxem::value> &target) override
+	step_result scan(scan_context &context, match_map &matches, std::shared_ptr<luxem::value> &target) const override
 		{ throw std::runtime_error("*type cannot be used in 'from' patterns."); }
 	
-	std::shared_ptr<luxem::value> generate(transform_context &context, match_map const &matches) override
+	std::shared_ptr<luxem::value> generate(transform_context &context, match_map const &matches) const override
 	{ 
 		auto out = transform_node(context, matches, value);
-		out->set_type(format_string(format, matches));
+		out->set_type(format.format(matches));
 		return out;
 	}
 };
@@ -223,60 +349,376 @@ struct build_string : special
 	static std::string const name;
 	std::string const &get_name(void) const override { return name; }
 
-	std::string format;
+	format_pattern format;
 
-	build_string(std::shared_ptr<luxem::value> &&data)
-		{ format = data->as<luxem::primitive>().get_string(); }
+	build_string(std::shared_ptr<luxem::value> &&data) : 
+		format(data->as<luxem::primitive>().get_string()) {}
 
-	step_result scan(scan_context &context, match_map &matches, std::shared_ptr<luxem::value> &target) override
+	step_result scan(scan_context &context, match_map &matches, std::shared_ptr<luxem::value> &target) const override
 		{ throw std::runtime_error("*string cannot be used in 'from' patterns."); }
 	
-	std::shared_ptr<luxem::value> generate(transform_context &context, match_map const &matches) override
-		{ return std::make_shared<luxem::primitive>(format_string(format, matches)); }
+	std::shared_ptr<luxem::value> generate(transform_context &context, match_map const &matches) const override
+		{ return std::make_shared<luxem::primitive>(format.format(matches)); }
 };
 
 std::string const build_string::name("*string");
 
+// Checks ECMAScript regex syntax as std::regex would, without the cost of compiling, so bad patterns are
+// reported at load.  Returns the number of marked subexpressions.  Collating element names aren't looked
+// up, so an unknown one is only reported when compiling.
+struct regex_syntax
+{
+	std::string const &pattern;
+	size_t position = 0;
+	size_t groups = 0;
+	std::vector<size_t> open;
+
+	regex_syntax(std::string const &pattern) : pattern(pattern) {}
+
+	[[noreturn]] void fail(char const *reason)
+	{
+		std::stringstream message;
+		message << "Invalid regex '" << pattern << "': " << reason << " at " << position << ".";
+		throw std::runtime_error(message.str());
+	}
+
+	bool at_end(void) const { return position >= pattern.size(); }
+	char peek(size_t ahead = 0) const { return position + ahead < pattern.size() ? pattern[position + ahead] : '\0'; }
+	static bool is_digit(char next) { return (next >= '0') && (next <= '9'); }
+	static bool is_hex(char next) { return is_digit(next) || (((next | 0x20) >= 'a') && ((next | 0x20) <= 'f')); }
+
+	size_t check(void)
+	{
+		disjunction();
+		if (!at_end()) fail("unmatched ')'");
+		return groups;
+	}
+
+	void disjunction(void)
+	{
+		while (true)
+		{
+			while (term()) {}
+			if (at_end() || (peek() != '|')) return;
+			++position;
+		}
+	}
+
+	// Returns false at the end of an alternative
+	bool term(void)
+	{
+		if (at_end()) return false;
+		char const next = peek();
+		if ((next == '|') || (next == ')')) return false;
+		if ((next == '^') || (next == '$')) { ++position; return true; }
+		if ((next == '\\') && ((peek(1) == 'b') || (peek(1) == 'B'))) { position += 2; return true; }
+		if ((next == '(') && (peek(1) == '?') && ((peek(2) == '=') || (peek(2) == '!')))
+		{
+			position += 3;
+			disjunction();
+			if (at_end() || (peek() != ')')) fail("unmatched '('");
+			++position;
+			return true;
+		}
+		atom();
+		while (quantifier()) {}
+		return true;
+	}
+
+	bool quantifier(void)
+	{
+		if (at_end()) return false;
+		char const next = peek();
+		if ((next == '*') || (next == '+') || (next == '?')) ++position;
+		else if (next == '{')
+		{
+			++position;
+			auto minimum = number();
+			if (!minimum.first) fail("bad repeat count");
+			if (peek() == ',')
+			{
+				++position;
+				auto maximum = number();
+				if (maximum.first && (maximum.second < minimum.second)) fail("bad repeat range");
+			}
+			if (at_end() || (peek() != '}')) fail("unmatched '{'");
+			++position;
+		}
+		else return false;
+		if (!at_end() && (peek() == '?')) ++position; // Lazy
+		return true;
+	}
+
+	std::pair<bool, size_t> number(void)
+	{
+		bool found = false;
+		size_t out = 0;
+		while (!at_end() && is_digit(peek()))
+		{
+			found = true;
+			out = out * 10 + (peek() - '0');
+			++position;
+		}
+		return {found, out};
+	}
+
+	void atom(void)
+	{
+		char const next = pattern[position++];
+		switch (next)
+		{
+			case '*': case '+': case '?': case '{': fail("nothing to repeat");
+			case '\\': escape(false); return;
+			case '[': bracket(); return;
+			case '(':
+			{
+				if ((peek() == '?') && (peek(1) == ':')) position += 2;
+				else open.push_back(++groups);
+				disjunction();
+				if (at_end() || (peek() != ')')) fail("unmatched '('");
+				++position;
+				if (!open.empty()) open.pop_back();
+				return;
+			}
+			default: return;
+		}
+	}
+
+	static int const class_term = std::numeric_limits<int>::min();
+	static int const named_term = std::numeric_limits<int>::max(); // Left for compiling to check
+
+	// Returns the character, or class_term
+	int escape(bool in_bracket)
+	{
+		if (at_end()) fail("trailing '\\'");
+		char const next = pattern[position++];
+		switch (next)
+		{
+			case 'd': case 'D': case 's': case 'S': case 'w': case 'W': return class_term;
+			case 'c':
+				if (at_end()) fail("bad control escape");
+				return pattern[position++];
+			case 'B':
+				if (in_bracket) fail("word boundary in '[...]'");
+				break;
+			case 'x': case 'u':
+			{
+				size_t const digits = next == 'x' ? 2 : 4;
+				int value = 0;
+				for (size_t index = 0; index < digits; ++index)
+				{
+					if (at_end() || !is_hex(peek())) fail("bad hex escape");
+					char const digit = pattern[position++];
+					value = value * 16 + (is_digit(digit) ? digit - '0' : (digit | 0x20) - 'a' + 10);
+				}
+				return static_cast<char>(value);
+			}
+			case 'f': return '\f';
+			case 'n': return '\n';
+			case 'r': return '\r';
+			case 't': return '\t';
+			case 'v': return '\v';
+			case '0': return '\0';
+			case 'b': return '\b';
+			default: break;
+		}
+		if (is_digit(next))
+		{
+			if (in_bracket) fail("back reference in '[...]'");
+			size_t reference = next - '0';
+			while (!at_end() && is_digit(peek())) reference = reference * 10 + (pattern[position++] - '0');
+			if ((reference > groups) ||
+				(std::find(open.begin(), open.end(), reference) != open.end()))
+				fail("bad back reference");
+			return class_term;
+		}
+		return next;
+	}
+
+	// Returns the character, or class_term
+	int bracket_term(char next)
+	{
+		if (next == '\\') return escape(true);
+		if ((next != '[') || ((peek() != ':') && (peek() != '.') && (peek() != '='))) return next;
+		char const kind = pattern[position++];
+		auto const start = position;
+		while (!at_end() && !((peek() == kind) && (peek(1) == ']'))) ++position;
+		if (at_end()) fail("unmatched '['");
+		auto const name = pattern.substr(start, position - start);
+		position += 2;
+		if (kind == ':')
+		{
+			static char const *const classes[] = {"alnum", "alpha", "blank", "cntrl", "digit", "graph", "lower", 
+				"print", "punct", "space", "upper", "xdigit", "d", "w", "s"};
+			std::string lower;
+			for (auto character : name) lower += ((character >= 'A') && (character <= 'Z')) ? character | 0x20 : character;
+			if (std::find(std::begin(classes), std::end(classes), lower) == std::end(classes)) 
+				fail("unknown character class");
+			return class_term;
+		}
+		if (name.empty()) fail("bad collating element");
+		for (auto character : name) 
+		{
+			bool const letter = ((character | 0x20) >= 'a') && ((character | 0x20) <= 'z');
+			if (!letter && (character != '-')) fail("bad collating element");
+		}
+		if (kind == '=') return class_term;
+		return name.size() == 1 ? name[0] : named_term;
+	}
+
+	void bracket(void)
+	{
+		if (peek() == '^') ++position;
+		while (true)
+		{
+			if (at_end()) fail("unmatched '['");
+			char const next = pattern[position++];
+			if (next == ']') return;
+			int const low = bracket_term(next);
+			if ((peek() == '-') && (peek(1) != ']') && (position + 1 < pattern.size()))
+			{
+				++position;
+				int const high = bracket_term(pattern[position++]);
+				if ((low == class_term) || (high == class_term)) fail("bad range");
+				if ((low != named_term) && (high != named_term) && (high < low)) fail("bad range");
+			}
+		}
+	}
+};
+
+// Regexes are pooled by pattern and flags and compiled on first use, since a transform file may contain many
+// duplicates and many patterns that never run.  Syntax is checked when pooled.
+struct pooled_regex
+{
+	std::string const pattern;
+	std::regex::flag_type const flags;
+	size_t const mark_count;
+
+	pooled_regex(std::string const &pattern, std::regex::flag_type flags) : 
+		pattern(pattern), flags(flags), mark_count(regex_syntax(pattern).check()) {}
+	~pooled_regex(void);
+
+	std::regex const &get(void) const;
+
+	private:
+		mutable std::once_flag compile_once;
+		mutable std::regex compiled;
+		mutable bool is_compiled = false;
+};
+
+struct regex_pool
+{
+	std::mutex mutex;
+	std::map<std::pair<std::string, std::regex::flag_type>, std::weak_ptr<pooled_regex>> entries;
+	std::atomic<size_t> compiled{0};
+	std::atomic<uint64_t> compile_nanoseconds{0};
+
+	static regex_pool &instance(void)
+	{
+		static regex_pool pool;
+		return pool;
+	}
+
+	std::shared_ptr<pooled_regex> get(std::string const &pattern, std::regex::flag_type flags)
+	{
+		std::lock_guard<std::mutex> guard(mutex);
+		auto &entry = entries[std::make_pair(pattern, flags)];
+		auto out = entry.lock();
+		if (!out) 
+		{
+			out = std::make_shared<pooled_regex>(pattern, flags);
+			entry = out;
+		}
+		return out;
+	}
+
+	size_t count(void)
+	{
+		std::lock_guard<std::mutex> guard(mutex);
+		for (auto entry = entries.begin(); entry != entries.end();)
+		{
+			if (entry->second.expired()) entry = entries.erase(entry);
+			else ++entry;
+		}
+		return entries.size();
+	}
+};
+
+pooled_regex::~pooled_regex(void)
+{
+	if (is_compiled) --regex_pool::instance().compiled;
+}
+
+std::regex const &pooled_regex::get(void) const
+{
+	std::call_once(compile_once, [this](void)
+	{
+		auto start = std::chrono::steady_clock::now();
+		try { compiled.assign(pattern, flags); }
+		catch (std::regex_error &error)
+		{
+			std::stringstream message;
+			message << "Invalid regex '" << pattern << "': " << error.what();
+			throw std::runtime_error(message.str());
+		}
+		auto &pool = regex_pool::instance();
+		pool.compile_nanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now() - start).count();
+		++pool.compiled;
+		is_compiled = true;
+	});
+	return compiled;
+}
+
 struct regex_definition
 {
 	struct id
 	{
 		bool valid;
-		std::string text;
-		id(bool valid, std::string const &text) : valid(valid), text(text) {}
+		symbol text;
+		id(bool valid, symbol text) : valid(valid), text(text) {}
 	};
 	std::vector<id> ids;
-	std::regex regex;
+	std::shared_ptr<pooled_regex> regex;
 	bool has_replace = false;
 	std::string replace;
 
 	regex_definition(std::shared_ptr<luxem::value> &&data)
 	{
-		if (data->is<luxem::primitive>()) regex = data->as<luxem::primitive>().get_primitive();
+		if (data->is<luxem::primitive>()) 
+			regex = regex_pool::instance().get(data->as<luxem::primitive>().get_primitive(), std::regex::ECMAScript);
 		else if (data->is<luxem::reader::object_context>())
 		{
 			auto &object = data->as<luxem::reader::object_context>();
 			auto has_pattern = std::make_shared<bool>(false);
-			object.element("id", [this](std::shared_ptr<luxem::value> &&data) 
-				{ ids.emplace_back(true, data->as<luxem::primitive>().get_string()); });
-			object.element("ids", [this](std::shared_ptr<luxem::value> &&data) 
+			auto has_ids = std::make_shared<bool>(false);
+			object.element("id", [this, has_ids](std::shared_ptr<luxem::value> &&data) 
+			{ 
+				ids.emplace_back(true, intern(data->as<luxem::primitive>().get_string())); 
+				*has_ids = true;
+			});
+			object.element("ids", [this, has_ids](std::shared_ptr<luxem::value> &&data) 
 			{ 
+				*has_ids = true;
 				data->as<luxem::reader::array_context>().element([this](std::shared_ptr<luxem::value> &&data)
 				{ 
 					if (data->has_type() && (data->get_type() == "null"))
-						ids.emplace_back(false, std::string{});
-					else ids.emplace_back(true, data->as<luxem::primitive>().get_string()); 
+						ids.emplace_back(false, nullptr);
+					else ids.emplace_back(true, intern(data->as<luxem::primitive>().get_string())); 
 				});
 			});
 			object.element("exp", [this, has_pattern](std::shared_ptr<luxem::value> &&data) 
-				{ regex = data->as<luxem::primitive>().get_string(); *has_pattern = true; });
+			{ 
+				regex = regex_pool::instance().get(data->as<luxem::primitive>().get_string(), std::regex::ECMAScript); 
+				*has_pattern = true; 
+			});
 			object.element("sub", [this](std::shared_ptr<luxem::value> &&data) 
 				{ replace = data->as<luxem::primitive>().get_string(); has_replace = true; });
-			object.finally([this, has_pattern](void)
+			object.finally([this, has_pattern, has_ids](void)
 			{
 				if (!*has_pattern) 
 					throw std::runtime_error("Regex missing pattern.");
-				if (!has_replace && (regex.mark_count() > ids.size())) 
+				if (*has_ids && !has_replace && (regex->mark_count > ids.size())) 
 					throw std::runtime_error("Regex has more ids than marked subexpressions.");
 				if (has_replace && ((ids.size() != 1) || !ids[0].valid)) 
 					throw std::runtime_error("Substitution regexes must have one id.");
@@ -285,16 +727,25 @@ struct regex_definition
 		else throw std::runtime_error("A regex pattern must be a primitive or object.");
 	}
 
-	bool test(std::string const &source, match_map &matches)
+	bool test(std::string const &source, match_map &matches) const
 	{
+		auto &compiled = regex->get();
 		if (has_replace)
-			matches.strings.emplace(ids[0].text, std::regex_replace(source, regex, replace));
+			matches.strings.emplace(ids[0].text, saved_string(std::regex_replace(source, compiled, replace)));
 		else
 		{
 			std::smatch results;
-			if (!std::regex_search(source, results, regex)) return false;
+			if (!std::regex_search(source, results, compiled)) return false;
 			for (size_t index = 0; index < ids.size(); ++index)
-				if (ids[index].valid) matches.strings.emplace(ids[index].text, results.str(index));
+			{
+				if (!ids[index].valid) continue;
+				auto &group = results[index];
+				matches.strings.emplace(
+					ids[index].text, 
+					group.matched ? 
+						saved_string(source.data() + (group.first - source.begin()), group.length()) : 
+						saved_string(source.data(), 0));
+			}
 		}
 		return true;
 	}
@@ -315,7 +766,7 @@ struct regex_definition_list
 		else assert(false);
 	}
 	
-	bool test(std::string const &source, match_map &matches)
+	bool test(std::string const &source, match_map &matches) const
 	{
 		for (auto &pattern : patterns)
 			if (!pattern->test(source, matches)) return false;
@@ -333,13 +784,14 @@ struct regex : special
 	regex(std::shared_ptr<luxem::value> &&data) 
 		{ value_definition.deserialize(std::move(data)); }
 
-	step_result scan(scan_context &context, match_map &matches, std::shared_ptr<luxem::value> &target) override
+	step_result scan(scan_context &context, match_map &matches, std::shared_ptr<luxem::value> &target) const override
 	{
+		if (!target->is<luxem::primitive>()) return step_fail;
 		if (!value_definition.test(target->as<luxem::primitive>().get_primitive(), matches)) return step_fail;
 		return step_break;
 	}
 	
-	std::shared_ptr<luxem::value> generate(transform_context &context, match_map const &matches) override
+	std::shared_ptr<luxem::value> generate(transform_context &context, match_map const &matches) const override
 		{ throw std::runtime_error("*regex cannot be used in 'to' patterns."); }
 };
 
@@ -373,27 +825,65 @@ struct type_regex : special
 				{ allow_missing = data->as<luxem::primitive>().get_bool(); });
 	}
 
-	step_result scan(scan_context &context, match_map &matches, std::shared_ptr<luxem::value> &target) override
+	step_result scan(scan_context &context, match_map &matches, std::shared_ptr<luxem::value> &target) const override
 	{
 		if (target->has_type() && !type_definition.test(target->get_type(), matches)) return step_fail;
 		else if (!allow_missing && !target->has_type()) return step_fail;
 		return scan_node(context, matches, target, value, true);
 	}
 	
-	std::shared_ptr<luxem::value> generate(transform_context &context, match_map const &matches) override
+	std::shared_ptr<luxem::value> generate(transform_context &context, match_map const &matches) const override
 		{ throw std::runtime_error("*type_regex cannot be used in 'to' patterns."); }
 };
 
 std::string const type_regex::name("*type_regex");
 
+size_t const alternate_reorder_interval = 1024;
+size_t const alternate_dispatch_minimum = 8;
+
+bool patterns_disjoint(luxem::value const &a, luxem::value const &b, size_t depth = 0);
+bool pattern_discriminator(luxem::value const &pattern, size_t &out, size_t depth = 0);
+size_t tree_discriminator(luxem::value const &tree);
+
 struct alternate : special
 {
 	static std::string const name;
 	std::string const &get_name(void) const override { return name; }
 	
 	std::vector<std::shared_ptr<luxem::value>> patterns;
+	bool adaptive = false, exclusive = false;
+
+	// Branch order, replaced (never modified) when adaptive.  The only state scans change, so it's mutable
+	// and safe to update concurrently.
+	mutable std::shared_ptr<std::vector<size_t> const> order;
+	std::unique_ptr<std::atomic<uint64_t>[]> hits;
+	mutable std::atomic<uint64_t> total_hits{0};
+	mutable std::mutex reorder_mutex;
+
+	// Candidate branches by discriminator, in declaration order.  Branches without a discriminator are
+	// candidates for every tree and alone make up fallback.
+	bool dispatch = false;
+	std::unordered_map<size_t, std::shared_ptr<std::vector<size_t> const>> dispatch_table;
+	std::shared_ptr<std::vector<size_t> const> fallback;
 
 	alternate(build_context &context, luxem::reader::array_context &array_data)
+	{
+		build_patterns(context, array_data);
+		build_finally(context, [this](void) { finish(); });
+	}
+
+	alternate(build_context &context, luxem::reader::object_context &object_data)
+	{
+		object_data.element("patterns", [this, &context](std::shared_ptr<luxem::value> &&data)
+			{ build_patterns(context, data->as<luxem::reader::array_context>()); });
+		object_data.element("adaptive", [this](std::shared_ptr<luxem::value> &&data)
+			{ adaptive = data->as<luxem::primitive>().get_bool(); });
+		object_data.element("exclusive", [this](std::shared_ptr<luxem::value> &&data)
+			{ exclusive = data->as<luxem::primitive>().get_bool(); });
+		build_finally(context, [this](void) { finish(); });
+	}
+
+	void build_patterns(build_context &context, luxem::reader::array_context &array_data)
 	{
 		array_data.build_struct(
 			[this](std::shared_ptr<luxem::value> &&data)
@@ -402,46 +892,135 @@ struct alternate : special
 				{ build_preprocess(context, data); });
 	}
 
-	step_result scan(scan_context &context, match_map &matches, std::shared_ptr<luxem::value> &target) override
+	// Called once the transform is built, since match definitions may be completed after the *alt
+	void finish(void)
+	{
+		auto identity = std::make_shared<std::vector<size_t>>(patterns.size());
+		for (size_t index = 0; index < patterns.size(); ++index) (*identity)[index] = index;
+		order = std::move(identity);
+
+		build_dispatch();
+		if (dispatch) adaptive = false;
+		if (!adaptive) return;
+
+		// Reordering only preserves results if at most one branch can match any tree
+		if (!exclusive)
+			for (size_t first = 0; first < patterns.size(); ++first)
+				for (size_t second = first + 1; second < patterns.size(); ++second)
+					if (!patterns_disjoint(*patterns[first], *patterns[second]))
+						throw std::runtime_error(
+							"Adaptive *alt patterns couldn't be proven mutually exclusive; "
+							"set 'exclusive: true' if they are.");
+		hits.reset(new std::atomic<uint64_t>[patterns.size()]);
+		for (size_t index = 0; index < patterns.size(); ++index) hits[index] = 0;
+	}
+
+	void build_dispatch(void)
+	{
+		std::vector<std::pair<size_t, size_t>> keyed;
+		auto unkeyed = std::make_shared<std::vector<size_t>>();
+		for (size_t index = 0; index < patterns.size(); ++index)
+		{
+			size_t discriminator;
+			if (pattern_discriminator(*patterns[index], discriminator)) 
+				keyed.emplace_back(discriminator, index);
+			else unkeyed->push_back(index);
+		}
+		if (keyed.size() < alternate_dispatch_minimum) return;
+
+		std::unordered_map<size_t, std::vector<size_t>> groups;
+		for (auto &pair : keyed) groups[pair.first].push_back(pair.second);
+		for (auto &group : groups)
+		{
+			auto candidates = std::make_shared<std::vector<size_t>>();
+			std::merge(
+				group.second.begin(), group.second.end(), 
+				unkeyed->begin(), unkeyed->end(), 
+				std::back_inserter(*candidates));
+			dispatch_table.emplace(group.first, std::move(candidates));
+		}
+		fallback = std::move(unkeyed);
+		dispatch = true;
+	}
+
+	std::shared_ptr<std::vector<size_t> const> candidates(luxem::value const &target) const
+	{
+		if (dispatch)
+		{
+			auto found = dispatch_table.find(tree_discriminator(target));
+			if (found == dispatch_table.end()) return fallback;
+			return found->second;
+		}
+		if (adaptive) return std::atomic_load(&order);
+		return order;
+	}
+
+	void record_hit(size_t branch) const
+	{
+		hits[branch].fetch_add(1, std::memory_order_relaxed);
+		if (total_hits.fetch_add(1, std::memory_order_relaxed) % alternate_reorder_interval != 
+			alternate_reorder_interval - 1) 
+			return;
+
+		std::unique_lock<std::mutex> lock(reorder_mutex, std::try_to_lock);
+		if (!lock) return;
+		std::vector<uint64_t> counts(patterns.size());
+		for (size_t index = 0; index < patterns.size(); ++index) 
+			counts[index] = hits[index].load(std::memory_order_relaxed);
+		auto next = std::make_shared<std::vector<size_t>>(*std::atomic_load(&order));
+		std::stable_sort(next->begin(), next->end(), [&counts](size_t first, size_t second) 
+			{ return counts[first] > counts[second]; });
+		std::atomic_store(&order, std::shared_ptr<std::vector<size_t> const>(std::move(next)));
+	}
+
+	step_result scan(scan_context &context, match_map &matches, std::shared_ptr<luxem::value> &target) const override
 	{
 		struct stackable : scan_stackable
 		{
+			alternate const &parent;
 			match_map &matches;
 			match_map branch_matches;
-			std::vector<std::shared_ptr<luxem::value>> &patterns;
-			std::vector<std::shared_ptr<luxem::value>>::iterator iterator;
+			std::shared_ptr<std::vector<size_t> const> order;
+			std::vector<size_t>::const_iterator iterator;
+			size_t branch;
 			std::shared_ptr<luxem::value> &target;
 
 			stackable(
+				alternate const &parent,
 				match_map &matches,
-				std::vector<std::shared_ptr<luxem::value>> &patterns,
+				std::shared_ptr<std::vector<size_t> const> &&order,
 				std::shared_ptr<luxem::value> &target) : 
+				parent(parent),
 				matches(matches),
-				patterns(patterns),
-				iterator(patterns.begin()),
+				order(std::move(order)),
+				iterator(this->order->begin()),
 				target(target)
 				{}
 
+			step_result succeed(void)
+			{
+				branch_matches.update(matches);
+				if (parent.adaptive) parent.record_hit(branch);
+				return step_break;
+			}
+
 			step_result step(scan_context &context, step_result last_result) override
 			{
-				if (last_result == step_break) 
-				{
-					branch_matches.update(matches);
-					return step_break;
-				}
-				if (iterator == patterns.end()) return step_fail;
+				if (last_result == step_break) return succeed();
+				if (iterator == order->end()) return step_fail;
+				branch = *iterator++;
 				branch_matches = matches;
-				auto result = scan_node(context, branch_matches, target, *iterator);
-				if (result == step_break) return step_break;
-				++iterator;
+				auto result = scan_node(context, branch_matches, target, parent.patterns[branch]);
+				if (result == step_break) return succeed();
+				if (result == step_push) return step_push;
 				return step_continue;
 			}
 		};
-		context.stack.emplace_back(std::make_unique<stackable>(matches, patterns, target));
+		context.stack.emplace_back(std::make_unique<stackable>(*this, matches, candidates(*target), target));
 		return step_push;
 	}
 	
-	std::shared_ptr<luxem::value> generate(transform_context &context, match_map const &matches) override
+	std::shared_ptr<luxem::value> generate(transform_context &context, match_map const &matches) const override
 		{ throw std::runtime_error("*alt cannot be used in 'to' patterns."); }
 };
 
@@ -456,10 +1035,10 @@ struct error : special
 
 	error(std::string const &message) : message(message) {}
 
-	step_result scan(scan_context &context, match_map &matches, std::shared_ptr<luxem::value> &target) override
+	step_result scan(scan_context &context, match_map &matches, std::shared_ptr<luxem::value> &target) const override
 		{ throw std::runtime_error("*error cannot be used in 'from' patterns."); }
 	
-	std::shared_ptr<luxem::value> generate(transform_context &context, match_map const &matches) override
+	std::shared_ptr<luxem::value> generate(transform_context &context, match_map const &matches) const override
 	{
 		if (message.empty()) throw std::runtime_error("Matched forbidden pattern.");
 		else throw std::runtime_error(message);
@@ -473,55 +1052,389 @@ struct wildcard : special
 	static std::string const name;
 	std::string const &get_name(void) const override { return name; }
 
-	step_result scan(scan_context &context, match_map &matches, std::shared_ptr<luxem::value> &target) override
+	step_result scan(scan_context &context, match_map &matches, std::shared_ptr<luxem::value> &target) const override
 	{ 
 		return step_break; 
 	}
 	
-	std::shared_ptr<luxem::value> generate(transform_context &context, match_map const &matches) override
+	std::shared_ptr<luxem::value> generate(transform_context &context, match_map const &matches) const override
 		{ throw std::runtime_error("*wild cannot be used in 'to' patterns."); }
 };
 
 std::string const wildcard::name("*wild");
 
-struct match_scan_stackable;
-struct match_definition
+// Elements around a *seq run or outside a *partial's keys, spliced when used in a 'to' array or object
+struct rest : special
 {
-	std::string id;
-	std::shared_ptr<luxem::value> pattern;
+	static std::string const name;
+	std::string const &get_name(void) const override { return name; }
 
-	match_definition(void) : pattern(std::make_shared<wildcard>()) {}
+	symbol id;
 
-	step_result scan(scan_context &context, match_map &matches, std::shared_ptr<luxem::value> &target)
+	rest(symbol id) : id(id) {}
+
+	step_result scan(scan_context &context, match_map &matches, std::shared_ptr<luxem::value> &target) const override
+		{ throw std::runtime_error("*rest can only be used at the start or end of *seq or as *partial's rest in 'from' patterns."); }
+
+	std::shared_ptr<luxem::value> const &find(match_map const &matches) const
 	{
-		struct match_scan_stackable : scan_stackable
+		auto found = matches.trees.find(id);
+		if (found == matches.trees.end())
 		{
-			match_map &matches;
-			std::string const &id;
-			std::shared_ptr<luxem::value> &target;
-			std::shared_ptr<luxem::value> pattern;
+			std::stringstream message;
+			message << "Rest " << *id << ", required by output, is missing.";
+			throw std::runtime_error(message.str());
+		}
+		return found->second;
+	}
 
-			match_scan_stackable(
-				match_map &matches, 
-				std::string const &id, 
-				std::shared_ptr<luxem::value> &target, 
-				std::shared_ptr<luxem::value> pattern) : 
-				matches(matches), 
-				id(id), 
-				target(target), 
-				pattern(pattern) 
-				{}
+	// The saved elements, to splice into a 'to' container of the same kind
+	template <typename container_type> auto const &splice(match_map const &matches) const
+	{
+		auto &saved = find(matches);
+		if (!saved->is<container_type>())
+		{
+			std::stringstream message;
+			message << "Rest " << *id << " can't be spliced into " << 
+				(std::is_same<container_type, luxem::object>::value ? "an object" : "an array") << 
+				", it was captured from " << saved->get_name() << ".";
+			throw std::runtime_error(message.str());
+		}
+		return saved->as<container_type>().get_data();
+	}
+	
+	std::shared_ptr<luxem::value> generate(transform_context &context, match_map const &matches) const override
+		{ return transform_node(context, matches, find(matches)); }
+};
 
-			step_result step(scan_context &context, step_result last_result) override
-			{
-				if (last_result == step_push)
+std::string const rest::name("*rest");
+
+// Structural equality with the same rules as scanning a pattern without specials
+bool literal_equal(luxem::value const &target, luxem::value const &pattern)
+{
+	if (target.has_type() != pattern.has_type()) return false;
+	if (pattern.has_type() && (target.get_type() != pattern.get_type())) return false;
+	if (pattern.is<luxem::primitive>())
+	{
+		return target.is<luxem::primitive>() && 
+			target.as<luxem::primitive>().get_primitive() == pattern.as<luxem::primitive>().get_primitive();
+	}
+	else if (pattern.is<luxem::object>())
+	{
+		if (!target.is<luxem::object>()) return false;
+		auto &target_data = target.as<luxem::object>().get_data();
+		auto &pattern_data = pattern.as<luxem::object>().get_data();
+		if (target_data.size() != pattern_data.size()) return false;
+		for (auto &pair : pattern_data)
+		{
+			auto found = target_data.find(pair.first);
+			if (found == target_data.end()) return false;
+			if (!literal_equal(*found->second, *pair.second)) return false;
+		}
+		return true;
+	}
+	else if (pattern.is<luxem::array>())
+	{
+		if (!target.is<luxem::array>()) return false;
+		auto &target_data = target.as<luxem::array>().get_data();
+		auto &pattern_data = pattern.as<luxem::array>().get_data();
+		if (target_data.size() != pattern_data.size()) return false;
+		for (size_t index = 0; index < pattern_data.size(); ++index)
+			if (!literal_equal(*target_data[index], *pattern_data[index])) return false;
+		return true;
+	}
+	return false;
+}
+
+bool is_literal(luxem::value const &pattern)
+{
+	if (pattern.is_derived<special>()) return false;
+	if (pattern.is<luxem::object>())
+	{
+		for (auto &pair : pattern.as<luxem::object>().get_data()) 
+			if (!is_literal(*pair.second)) return false;
+	}
+	else if (pattern.is<luxem::array>())
+	{
+		for (auto &element : pattern.as<luxem::array>().get_data()) 
+			if (!is_literal(*element)) return false;
+	}
+	return true;
+}
+
+// Matches the first contiguous run of elements in an array, optionally saving the elements before and after 
+// it with *rest.  Runs without specials are found with Knuth-Morris-Pratt.
+struct sequence : special
+{
+	static std::string const name;
+	std::string const &get_name(void) const override { return name; }
+
+	std::vector<std::shared_ptr<luxem::value>> run;
+	symbol before = nullptr, after = nullptr;
+	bool literal = false;
+	std::vector<size_t> fallback; // KMP failure function, if literal
+
+	sequence(build_context &context, luxem::reader::array_context &array_data)
+	{
+		array_data.build_struct(
+			[this](std::shared_ptr<luxem::value> &&data)
+				{ run.emplace_back(std::move(data)); },
+			[this, &context](std::string const &, std::shared_ptr<luxem::value> &data)
+				{ build_preprocess(context, data); });
+		build_finally(context, [this](void) { finish(); });
+	}
+
+	void finish(void)
+	{
+		if (!run.empty() && run.front()->is<rest>()) 
+		{
+			before = run.front()->as<rest>().id;
+			run.erase(run.begin());
+		}
+		if (!run.empty() && run.back()->is<rest>()) 
+		{
+			after = run.back()->as<rest>().id;
+			run.pop_back();
+		}
+
+		literal = std::all_of(run.begin(), run.end(), [](auto const &element) { return is_literal(*element); });
+		if (!literal) return;
+		fallback.resize(run.size(), 0);
+		size_t matched = 0;
+		for (size_t index = 1; index < run.size(); ++index)
+		{
+			while (matched && !literal_equal(*run[index], *run[matched])) matched = fallback[matched - 1];
+			if (literal_equal(*run[index], *run[matched])) ++matched;
+			fallback[index] = matched;
+		}
+	}
+
+	// Saves the *rest captures around a run found at start
+	void save(match_map &matches, luxem::array::array_data const &data, size_t start) const
+	{
+		if (before)
+		{
+			auto out = std::make_shared<luxem::array>();
+			out->get_data().assign(data.begin(), data.begin() + start);
+			matches.trees.emplace(before, out);
+		}
+		if (after)
+		{
+			auto out = std::make_shared<luxem::array>();
+			out->get_data().assign(data.begin() + start + run.size(), data.end());
+			matches.trees.emplace(after, out);
+		}
+	}
+
+	step_result scan(scan_context &context, match_map &matches, std::shared_ptr<luxem::value> &target) const override
+	{
+		struct sequence_scan_stackable : scan_stackable
+		{
+			sequence const &pattern;
+			match_map &matches;
+			luxem::array::array_data &data;
+			size_t start, element;
+			match_map attempt;
+
+			sequence_scan_stackable(sequence const &pattern, match_map &matches, luxem::array::array_data &data) :
+				pattern(pattern),
+				matches(matches),
+				data(data),
+				start(0),
+				element(0)
+				{}
+
+			step_result step(scan_context &context, step_result last_result) override
+			{
+				while (true)
+				{
+					if (last_result == step_break) ++element;
+					else if (last_result == step_fail)
+					{
+						++start;
+						element = 0;
+						attempt = match_map();
+					}
+					if (start + pattern.run.size() > data.size()) return step_fail;
+					if (element == pattern.run.size())
+					{
+						attempt.update(matches);
+						pattern.save(matches, data, start);
+						return step_break;
+					}
+					last_result = scan_node(context, attempt, data[start + element], pattern.run[element]);
+					if (last_result == step_push) return step_push;
+				}
+			}
+		};
+
+		if (!target->is<luxem::array>()) return step_fail;
+		auto &data = target->as<luxem::array>().get_data();
+		if (run.size() > data.size()) return step_fail;
+
+		if (!literal)
+		{
+			context.stack.emplace_back(std::make_unique<sequence_scan_stackable>(*this, matches, data));
+			return step_push;
+		}
+
+		if (run.empty())
+		{
+			save(matches, data, 0);
+			return step_break;
+		}
+		size_t matched = 0;
+		for (size_t index = 0; index < data.size(); ++index)
+		{
+			while (matched && !literal_equal(*data[index], *run[matched])) matched = fallback[matched - 1];
+			if (literal_equal(*data[index], *run[matched])) ++matched;
+			if (matched == run.size())
+			{
+				save(matches, data, index + 1 - run.size());
+				return step_break;
+			}
+		}
+		return step_fail;
+	}
+	
+	std::shared_ptr<luxem::value> generate(transform_context &context, match_map const &matches) const override
+		{ throw std::runtime_error("*seq cannot be used in 'to' patterns."); }
+};
+
+std::string const sequence::name("*seq");
+
+// Matches objects with at least the listed keys, optionally saving the other elements
+struct partial : special
+{
+	static std::string const name;
+	std::string const &get_name(void) const override { return name; }
+
+	std::shared_ptr<luxem::value> keys;
+	symbol remainder = nullptr;
+
+	partial(build_context &context, luxem::reader::object_context &object_data)
+	{
+		object_data.build_struct(
+			"keys",
+			[this](std::shared_ptr<luxem::value> &&data)
+			{ 
+				if (!data->is<luxem::object>()) throw std::runtime_error("*partial keys must be an object.");
+				keys = std::move(data); 
+			},
+			[this, &context](std::string const &, std::shared_ptr<luxem::value> &data)
+				{ build_preprocess(context, data); });
+		object_data.element(
+			"rest",
+			[this](std::shared_ptr<luxem::value> &&data)
+				{ remainder = intern(data->as<luxem::primitive>().get_primitive()); });
+		object_data.finally([this](void)
+			{ if (!keys) throw std::runtime_error("*partial is missing keys."); });
+	}
+
+	// Saves the unlisted elements, sharing rather than copying them
+	void save(match_map &matches, luxem::object::object_data const &target) const
+	{
+		if (!remainder) return;
+		auto &key_data = keys->as<luxem::object>().get_data();
+		auto out = std::make_shared<luxem::object>();
+		for (auto &pair : target)
+			if (!key_data.count(pair.first)) out->get_data().emplace_hint(out->get_data().end(), pair);
+		matches.trees.emplace(remainder, out);
+	}
+
+	step_result scan(scan_context &context, match_map &matches, std::shared_ptr<luxem::value> &target) const override
+	{
+		struct partial_scan_stackable : scan_stackable
+		{
+			partial const &pattern;
+			match_map &matches;
+			luxem::object::object_data &target;
+			luxem::object::object_data const &keys;
+			luxem::object::object_data::const_iterator iterator;
+
+			partial_scan_stackable(
+				partial const &pattern,
+				match_map &matches, 
+				luxem::object::object_data &target, 
+				luxem::object::object_data const &keys) :
+				pattern(pattern),
+				matches(matches),
+				target(target),
+				keys(keys),
+				iterator(keys.begin())
+				{}
+
+			step_result step(scan_context &context, step_result last_result) override
+			{
+				while (true)
+				{
+					if (last_result == step_fail) return step_fail;
+					if (iterator == keys.end()) 
+					{
+						pattern.save(matches, target);
+						return step_break;
+					}
+					auto found = target.find(iterator->first);
+					if (found == target.end()) return step_fail;
+					last_result = scan_node(context, matches, found->second, iterator->second);
+					++iterator;
+					if (last_result == step_push) return step_push;
+				}
+			}
+		};
+
+		if (!target->is<luxem::object>()) return step_fail;
+		auto &target_data = target->as<luxem::object>().get_data();
+		auto &key_data = keys->as<luxem::object>().get_data();
+		if (target_data.size() < key_data.size()) return step_fail;
+		context.stack.emplace_back(std::make_unique<partial_scan_stackable>(*this, matches, target_data, key_data));
+		return step_push;
+	}
+	
+	std::shared_ptr<luxem::value> generate(transform_context &context, match_map const &matches) const override
+		{ throw std::runtime_error("*partial cannot be used in 'to' patterns."); }
+};
+
+std::string const partial::name("*partial");
+
+struct match_scan_stackable;
+struct match_definition
+{
+	symbol id;
+	std::shared_ptr<luxem::value> pattern;
+
+	match_definition(void) : pattern(std::make_shared<wildcard>()) {}
+
+	step_result scan(scan_context &context, match_map &matches, std::shared_ptr<luxem::value> &target) const
+	{
+		struct match_scan_stackable : scan_stackable
+		{
+			match_map &matches;
+			symbol id;
+			std::shared_ptr<luxem::value> &target;
+			std::shared_ptr<luxem::value> pattern;
+
+			match_scan_stackable(
+				match_map &matches, 
+				symbol id, 
+				std::shared_ptr<luxem::value> &target, 
+				std::shared_ptr<luxem::value> pattern) : 
+				matches(matches), 
+				id(id), 
+				target(target), 
+				pattern(pattern) 
+				{}
+
+			step_result step(scan_context &context, step_result last_result) override
+			{
+				if (last_result == step_push)
 				{
 					last_result = scan_node(context, matches, target, pattern);
 					if (last_result == step_push) return step_push;
 				}
 				if (last_result == step_fail) return step_fail;
 
-				if (context.verbose) std::cerr << "Saving match " << id << std::endl;
+				if (context.verbose) std::cerr << "Saving match " << *id << std::endl;
 				matches.trees.emplace(id, target);
 				return last_result;
 			}
@@ -531,366 +1444,2561 @@ struct match_definition
 		return step_push;
 	}
 
-	std::shared_ptr<luxem::value> generate(transform_context &context, match_map const &matches)
+	std::shared_ptr<luxem::value> const &find(match_map const &matches) const
 	{
 		auto found = matches.trees.find(id);
 		if (found == matches.trees.end())
 		{
 			std::stringstream message;
-			message << "Match " << id << ", required by output, is missing.";
+			message << "Match " << *id << ", required by output, is missing.";
 			throw std::runtime_error(message.str());
 		}
-		return transform_node(context, matches, found->second);
+		return found->second;
 	}
+
+	std::shared_ptr<luxem::value> generate(transform_context &context, match_map const &matches) const
+		{ return transform_node(context, matches, find(matches)); }
 };
 
 struct match_definition_standin : std::shared_ptr<match_definition>, special
 {
 	using std::shared_ptr<match_definition>::shared_ptr;
 	using std::shared_ptr<match_definition>::operator =;
+	match_definition_standin(std::shared_ptr<match_definition> const &definition) :
+		std::shared_ptr<match_definition>(definition) {}
 
 	static std::string const name;
 	std::string const &get_name(void) const override { return name; }
 	
-	step_result scan(scan_context &context, match_map &matches, std::shared_ptr<luxem::value> &target) override
+	step_result scan(scan_context &context, match_map &matches, std::shared_ptr<luxem::value> &target) const override
 		{ return (*this)->scan(context, matches, target); }
 	
-	std::shared_ptr<luxem::value> generate(transform_context &context, match_map const &matches) override
+	std::shared_ptr<luxem::value> generate(transform_context &context, match_map const &matches) const override
 		{ return (*this)->generate(context, matches); }
 };
 	
 std::string const match_definition_standin::name("*match");
-	
-///////////////////////////////////////////////////////////////////////////////
-// scanning
 
-struct scan_root_stackable : scan_stackable
+size_t const disjoint_depth_limit = 64;
+
+size_t discriminator_combine(size_t seed, size_t value)
+	{ return seed ^ (value + 0x9e3779b97f4a7c15ull + (seed << 6) + (seed >> 2)); }
+
+// Hashes what any matching pattern must have in common with tree: kind, type, and value or size
+size_t tree_discriminator(luxem::value const &tree)
 {
-	std::shared_ptr<luxem::value> &root;
+	static std::hash<std::string> const hash_string;
+	size_t out;
+	if (tree.is<luxem::primitive>()) 
+		out = discriminator_combine(1, hash_string(tree.as<luxem::primitive>().get_primitive()));
+	else if (tree.is<luxem::object>()) 
+		out = discriminator_combine(2, tree.as<luxem::object>().get_data().size());
+	else if (tree.is<luxem::array>()) 
+		out = discriminator_combine(3, tree.as<luxem::array>().get_data().size());
+	else out = 0;
+	if (tree.has_type()) out = discriminator_combine(out, hash_string(tree.get_type()));
+	return out;
+}
 
-	struct substackable
+// Gets the tree_discriminator all trees matching pattern share, if there is one
+bool pattern_discriminator(luxem::value const &pattern, size_t &out, size_t depth)
+{
+	if (depth > disjoint_depth_limit) return false;
+	if (pattern.is<match_definition_standin>())
 	{
-		std::function<step_result(scan_context &context, step_result last_result, std::unique_ptr<substackable> &next_state)> callback;
-		template <typename callback_type> substackable(callback_type &&callback) : callback(std::move(callback)) {}
-		step_result step(scan_context &context, step_result last_result, std::unique_ptr<substackable> &next_state)
-			{ return callback(context, last_result, next_state); }
-	};
+		auto &definition = pattern.as<match_definition_standin>();
+		if (!definition || !definition->pattern) return false;
+		return pattern_discriminator(*definition->pattern, out, depth + 1);
+	}
+	if (pattern.is_derived<special>()) return false;
+	out = tree_discriminator(pattern);
+	return true;
+}
+
+// Conservatively checks that no tree can be matched by both a and b
+bool patterns_disjoint(luxem::value const &a, luxem::value const &b, size_t depth)
+{
+	if (depth > disjoint_depth_limit) return false;
+	++depth;
 
-	step_result begin_recurse(std::unique_ptr<substackable> &next_state)
+	for (auto pair : {std::make_pair(&a, &b), std::make_pair(&b, &a)})
 	{
-		if (root->is<luxem::object>())
+		auto &first = *pair.first;
+		auto &second = *pair.second;
+		if (first.is<match_definition_standin>())
 		{
-			auto &data = root->as<luxem::object>().get_data();
-			auto temp = std::move(next_state);
-			next_state = std::make_unique<substackable>(
-				[this, &data, iterator = data.begin()](
-					scan_context &context, 
-					step_result last_result, 
-					std::unique_ptr<substackable> &next_state) mutable
-				{
-					if (iterator == data.end()) return step_break;
-					context.stack.push_back(std::make_unique<scan_root_stackable>(iterator->second));
-					++iterator;
-					return step_push;
-				});
+			auto &definition = first.as<match_definition_standin>();
+			if (!definition || !definition->pattern) return false;
+			return patterns_disjoint(*definition->pattern, second, depth);
 		}
-		else if (root->is<luxem::array>())
+		if (first.is<alternate>())
 		{
-			auto &data = root->as<luxem::array>().get_data();
-			next_state = std::make_unique<substackable>(
-				[this, &data, iterator = data.begin()](
-					scan_context &context, 
-					step_result last_result, 
-					std::unique_ptr<substackable> &next_state) mutable
-				{
-					if (iterator == data.end()) return step_break;
-					context.stack.push_back(std::make_unique<scan_root_stackable>(*iterator));
-					++iterator;
-					return step_push;
-				});
+			for (auto &pattern : first.as<alternate>().patterns)
+				if (!patterns_disjoint(*pattern, second, depth)) return false;
+			return true;
 		}
-		else return step_break;
-		return step_continue;
 	}
-	
-	step_result begin_subtransform(scan_context &context, std::unique_ptr<substackable> &next_state)
+	if (a.is_derived<special>() || b.is_derived<special>()) return false;
+
+	if (a.get_name() != b.get_name()) return true;
+	if (a.has_type() != b.has_type()) return true;
+	if (a.has_type() && (a.get_type() != b.get_type())) return true;
+	if (a.is<luxem::primitive>()) 
+		return a.as<luxem::primitive>().get_primitive() != b.as<luxem::primitive>().get_primitive();
+	if (a.is<luxem::object>())
 	{
-		auto temp = std::move(next_state);
-		next_state = std::make_unique<substackable>(
-			[this, iterator = context.transform_stack.back()->subtransforms.begin()](
-				scan_context &context, 
-				step_result last_result, 
-				std::unique_ptr<substackable> &next_state) mutable
-			{
-				if (last_result != step_continue)
-					context.transform_stack.pop_back();
-				if (iterator == context.transform_stack.back()->subtransforms.end()) 
-				{
-					return begin_recurse(next_state);
-				}
-				context.transform_stack.push_back(iterator->get());
-				context.stack.push_back(std::make_unique<scan_root_stackable>(root));
-				++iterator;
-				return step_push;
-			});
-		return step_continue;
+		auto &a_data = a.as<luxem::object>().get_data();
+		auto &b_data = b.as<luxem::object>().get_data();
+		if (a_data.size() != b_data.size()) return true;
+		for (auto &pair : a_data)
+		{
+			auto found = b_data.find(pair.first);
+			if (found == b_data.end()) return true;
+			if (patterns_disjoint(*pair.second, *found->second, depth)) return true;
+		}
+		return false;
+	}
+	if (a.is<luxem::array>())
+	{
+		auto &a_data = a.as<luxem::array>().get_data();
+		auto &b_data = b.as<luxem::array>().get_data();
+		if (a_data.size() != b_data.size()) return true;
+		for (size_t index = 0; index < a_data.size(); ++index)
+			if (patterns_disjoint(*a_data[index], *b_data[index], depth)) return true;
+		return false;
 	}
+	return false;
+}
 
-	std::unique_ptr<substackable> state;
+// Conservatively checks whether pattern could match some array
+bool pattern_may_match_array(luxem::value const &pattern, size_t depth = 0)
+{
+	if (depth > disjoint_depth_limit) return true;
+	++depth;
+	if (pattern.is<match_definition_standin>())
+	{
+		auto &definition = pattern.as<match_definition_standin>();
+		if (!definition || !definition->pattern) return true;
+		return pattern_may_match_array(*definition->pattern, depth);
+	}
+	if (pattern.is<alternate>())
+	{
+		for (auto &branch : pattern.as<alternate>().patterns)
+			if (pattern_may_match_array(*branch, depth)) return true;
+		return false;
+	}
+	if (pattern.is<type_regex>())
+	{
+		auto &value = pattern.as<type_regex>().value;
+		return !value || pattern_may_match_array(*value, depth);
+	}
+	if (pattern.is<regex>() || pattern.is<partial>()) return false;
+	if (pattern.is_derived<special>()) return true;
+	return pattern.is<luxem::array>();
+}
+	
+///////////////////////////////////////////////////////////////////////////////
+// scopes
+
+// A scope state is the set of positions reached in a scope's steps, one bit per position.  Once a path 
+// has matched every step the state is scope_inside, which all descendants inherit.
+typedef uint64_t scope_state;
+scope_state const scope_inside = scope_state(1) << 63;
 
-	scan_root_stackable(std::shared_ptr<luxem::value> &root) : root(root) 
+struct luxemog::transform::transform_data::scope_pattern
+{
+	struct step
 	{
-		state = std::make_unique<substackable>(
-			[this, matches = match_map()](
-				scan_context &context, 
-				step_result last_result, 
-				std::unique_ptr<substackable> &next_state) mutable
-			{
-				// Start by scanning root
-				if (last_result == step_push)
-				{
-					if (context.verbose) 
-						std::cerr << "Scanning " << this->root->get_name() << std::endl;
-					if (!context.get_from()) 
-						throw std::runtime_error("Transform missing 'from' pattern.");
-					last_result = scan_node(context, matches, this->root, context.get_from());
-					if (last_result == step_push) return step_push;
-				}
+		enum step_kind { key_step, index_step, wild_step, type_step, deep_step } kind;
+		std::string text;
+		size_t index;
+	};
+	std::vector<step> steps;
 
-				// Scan finished, transform if successful
-				if (last_result == step_fail) 
+	scope_pattern(std::shared_ptr<luxem::value> &&data)
+	{
+		data->as<luxem::reader::array_context>().element([this](std::shared_ptr<luxem::value> &&data)
+		{
+			if (steps.size() >= 63) throw std::runtime_error("Scopes can have at most 63 steps.");
+			auto &text = data->as<luxem::primitive>().get_primitive();
+			step next{step::key_step, text, 0};
+			if (data->has_type())
+			{
+				auto &type = data->get_type();
+				if (type == "*index") 
 				{
-					if (context.verbose) 
-						std::cerr << "Failed to match " << this->root->get_name() << std::endl;
+					next.kind = step::index_step;
+					next.index = std::stoul(text);
 				}
+				else if (type == "*wild") next.kind = step::wild_step;
+				else if (type == "*type") next.kind = step::type_step;
+				else if (type == "*deep") next.kind = step::deep_step;
 				else
 				{
-					if (context.verbose) 
-						std::cerr << "Matched " << this->root->get_name() << std::endl;
-					if (context.get_to())
-						transform_root(matches, this->root, context.get_to(), context.verbose);
-					return begin_subtransform(context, next_state);
+					std::stringstream message;
+					message << "Unknown scope step type '" << type << "'.";
+					throw std::runtime_error(message.str());
 				}
+			}
+			steps.push_back(std::move(next));
+		});
+	}
 
-				return begin_recurse(next_state);
-			});
+	scope_state bit(size_t position) const
+		{ return position == steps.size() ? scope_inside : (scope_state(1) << position); }
+
+	// (*deep) can match zero levels
+	scope_state close(scope_state state) const
+	{
+		for (size_t position = 0; position < steps.size(); ++position)
+			if ((state & bit(position)) && (steps[position].kind == step::deep_step)) 
+				state |= bit(position + 1);
+		return state;
 	}
 
-	step_result step(scan_context &context, step_result last_result) override
-		{ return state->callback(context, last_result, state); }
-};
+	scope_state start(void) const { return close(bit(0)); }
 
-struct object_scan_stackable : scan_stackable
+	// key is null for array elements
+	scope_state advance(scope_state state, std::string const *key, size_t index, luxem::value const &child) const
+	{
+		scope_state out = 0;
+		for (size_t position = 0; position < steps.size(); ++position)
+		{
+			if (!(state & bit(position))) continue;
+			auto &current = steps[position];
+			switch (current.kind)
+			{
+				case step::key_step: if (key && (*key == current.text)) out |= bit(position + 1); break;
+				case step::index_step: if (!key && (index == current.index)) out |= bit(position + 1); break;
+				case step::wild_step: out |= bit(position + 1); break;
+				case step::type_step: 
+					if (child.has_type() && (child.get_type() == current.text)) out |= bit(position + 1); 
+					break;
+				case step::deep_step: out |= bit(position); break;
+			}
+		}
+		return close(out);
+	}
+};
+
+scope_state scope_start(luxemog::transform::transform_data const &data)
+	{ return data.scope ? data.scope->start() : scope_inside; }
+
+// Returns 0 if neither child nor its descendants can be in scope
+scope_state scope_advance(
+	luxemog::transform::transform_data const &data, 
+	scope_state state, 
+	std::string const *key, 
+	size_t index, 
+	luxem::value const &child)
 {
-	match_map &matches;
-	luxem::object &target, &from;
+	if (state & scope_inside) return scope_inside;
+	return data.scope->advance(state, key, index, child);
+}
 
-	luxem::object::object_data::iterator iterator;
+///////////////////////////////////////////////////////////////////////////////
+// memoization
 
-	object_scan_stackable(match_map &matches, luxem::object &target, luxem::object &from) :
-		matches(matches),
-		target(target),
-		from(from),
-		iterator(from.get_data().begin())
-		{}
+size_t const memo_minimum_nodes = 16;
 
-	step_result step(scan_context &context, step_result last_result) override
+struct luxemog::transform_memo
+{
+	struct key
 	{
-		if (last_result == step_fail) return step_fail;
-		if (iterator == from.get_data().end()) return step_break;
-		auto target_found = target.get_data().find(iterator->first);
-		if (target_found == target.get_data().end()) return step_fail;
-		auto result = scan_node(context, matches, target_found->second, iterator->second);
-		if (result == step_fail) return step_fail;
-		++iterator;
-		return result;
+		luxemog::transform::transform_data const *transform;
+		bool reverse;
+		scope_state scope;
+		tree_digest digest;
+
+		bool operator ==(key const &other) const
+		{
+			return transform == other.transform && 
+				reverse == other.reverse && 
+				scope == other.scope && 
+				digest == other.digest; 
+		}
+	};
+
+	struct key_hash
+	{
+		size_t operator()(key const &value) const
+		{
+			return discriminator_combine(
+				discriminator_combine(value.digest.first, value.scope), 
+				reinterpret_cast<size_t>(value.transform) + value.reverse);
+		}
+	};
+
+	struct entry
+	{
+		key id;
+		bool changed;
+		std::shared_ptr<luxem::value> output; // Never modified, only copied out
+	};
+
+	size_t const capacity;
+	std::mutex mutex;
+	std::list<entry> entries; // Most recently used first
+	std::unordered_map<key, std::list<entry>::iterator, key_hash> index;
+
+	transform_memo(size_t capacity) : capacity(capacity) {}
+
+	bool find(key const &id, bool &changed, std::shared_ptr<luxem::value> &output)
+	{
+		std::lock_guard<std::mutex> guard(mutex);
+		auto found = index.find(id);
+		if (found == index.end()) return false;
+		entries.splice(entries.begin(), entries, found->second);
+		changed = found->second->changed;
+		output = found->second->output;
+		return true;
+	}
+
+	void store(key const &id, bool changed, std::shared_ptr<luxem::value> &&output)
+	{
+		std::lock_guard<std::mutex> guard(mutex);
+		auto found = index.find(id);
+		if (found != index.end())
+		{
+			entries.erase(found->second);
+			index.erase(found);
+		}
+		entries.push_front({id, changed, std::move(output)});
+		index.emplace(id, entries.begin());
+		while (entries.size() > capacity)
+		{
+			index.erase(entries.back().id);
+			entries.pop_back();
+		}
 	}
 };
 
-struct array_scan_stackable : scan_stackable
+// The second hash of a tree_digest, mixed independently of discriminator_combine and std::hash
+uint64_t digest_combine(uint64_t seed, uint64_t value)
 {
-	match_map &matches;
-	luxem::array &target, &from;
+	seed = (seed ^ value) * 0x87c37b91114253d5ull;
+	seed = (seed << 31) | (seed >> 33);
+	return seed * 0x4cf5ad432745937full;
+}
 
-	luxem::array::array_data::iterator target_iterator, from_iterator;
+uint64_t digest_string(std::string const &text)
+{
+	uint64_t out = 0xcbf29ce484222325ull ^ text.size();
+	for (unsigned char character : text) out = (out ^ character) * 0x100000001b3ull;
+	return digest_combine(out, text.size());
+}
 
-	array_scan_stackable(match_map &matches, luxem::array &target, luxem::array &from) :
-		matches(matches),
-		target(target),
-		from(from),
-		target_iterator(target.get_data().begin()),
-		from_iterator(from.get_data().begin())
-		{}
+uint64_t digest_discriminator(luxem::value const &tree)
+{
+	uint64_t out;
+	if (tree.is<luxem::primitive>()) 
+		out = digest_combine(1, digest_string(tree.as<luxem::primitive>().get_primitive()));
+	else if (tree.is<luxem::object>()) 
+		out = digest_combine(2, tree.as<luxem::object>().get_data().size());
+	else if (tree.is<luxem::array>()) 
+		out = digest_combine(3, tree.as<luxem::array>().get_data().size());
+	else out = 0;
+	if (tree.has_type()) out = digest_combine(digest_combine(out, 4), digest_string(tree.get_type()));
+	return out;
+}
 
-	step_result step(scan_context &context, step_result last_result) override
+// Digests the structure and contents of every subtree of root, keeping those large enough to memoize
+void hash_subtrees(std::shared_ptr<luxem::value> &root, subtree_hashes &hashes)
+{
+	static std::hash<std::string> const hash_string;
+	struct pending { std::shared_ptr<luxem::value> *node; bool children_done; };
+	std::vector<pending> stack{{&root, false}};
+	std::unordered_map<luxem::value const *, tree_digest> done;
+	while (!stack.empty())
 	{
-		if (last_result == step_fail) return step_fail;
-		if (from_iterator == from.get_data().end()) return step_break;
-		auto result = scan_node(context, matches, *target_iterator, *from_iterator);
-		if (result == step_fail) return step_fail;
-		++target_iterator;
-		++from_iterator;
-		return result;
+		auto current = stack.back();
+		stack.pop_back();
+		auto &node = **current.node;
+		if (done.count(&node)) continue;
+
+		if (!current.children_done)
+		{
+			stack.push_back({current.node, true});
+			if (node.is<luxem::object>())
+				for (auto &child : node.as<luxem::object>().get_data()) stack.push_back({&child.second, false});
+			else if (node.is<luxem::array>())
+				for (auto &child : node.as<luxem::array>().get_data()) stack.push_back({&child, false});
+			continue;
+		}
+
+		tree_digest digest{tree_discriminator(node), digest_discriminator(node), 1};
+		auto add = [&](luxem::value const &child)
+		{
+			auto &child_digest = done.at(&child);
+			digest.first = discriminator_combine(digest.first, child_digest.first);
+			digest.second = digest_combine(digest.second, child_digest.second);
+			digest.nodes += child_digest.nodes;
+		};
+		if (node.is<luxem::object>())
+		{
+			for (auto &child : node.as<luxem::object>().get_data())
+			{
+				digest.first = discriminator_combine(digest.first, hash_string(child.first));
+				digest.second = digest_combine(digest.second, digest_string(child.first));
+				add(*child.second);
+			}
+		}
+		else if (node.is<luxem::array>())
+			for (auto &child : node.as<luxem::array>().get_data()) add(*child);
+		done.emplace(&node, digest);
+		if (digest.nodes >= memo_minimum_nodes) hashes.emplace(&node, subtree_hash{digest, *current.node});
 	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// subtree summaries
+
+// Containers only, since a primitive is as quick to scan as to look up
+struct luxemog::subtree_summaries
+{
+	std::unordered_map<luxem::value const *, subtree_summary> nodes;
 };
 
-step_result scan_node(
-	scan_context &context, 
-	match_map &matches, 
-	std::shared_ptr<luxem::value> &target,
-	std::shared_ptr<luxem::value> const &from,
-	bool ignore_type)
+uint64_t feature_bit(size_t hash) 
+	{ return uint64_t(1) << ((uint64_t(hash) * 0x9E3779B97F4A7C15ull) >> 58); }
+
+uint64_t type_feature(std::string const &type)
 {
-	if (context.verbose) std::cerr << "Comparing " << target->get_name() << " to " << from->get_name() << std::endl;
+	static std::hash<std::string> const hash_string;
+	return feature_bit(hash_string(type) ^ 0x5555);
+}
 
-	auto check_type = [&](void)
+uint64_t key_feature(std::string const &key)
+{
+	static std::hash<std::string> const hash_string;
+	return feature_bit(hash_string(key));
+}
+
+uint64_t literal_feature(std::string const &primitive)
+{
+	static std::hash<std::string> const hash_string;
+	return feature_bit(hash_string(primitive));
+}
+
+void summarize_subtrees(std::shared_ptr<luxem::value> &root, luxemog::subtree_summaries &summaries)
+{
+	struct pending { std::shared_ptr<luxem::value> *node; bool children_done; };
+	std::vector<pending> stack{{&root, false}};
+	std::unordered_map<luxem::value const *, feature_set> done;
+	while (!stack.empty())
 	{
-		if (ignore_type) return true;
-		if (target->has_type() != from->has_type()) return false;
-		if (from->has_type() && (target->get_type() != from->get_type())) return false;
+		auto current = stack.back();
+		stack.pop_back();
+		auto &node = **current.node;
+		if (done.count(&node)) continue;
+
+		if (!current.children_done)
+		{
+			stack.push_back({current.node, true});
+			if (node.is<luxem::object>())
+				for (auto &child : node.as<luxem::object>().get_data()) stack.push_back({&child.second, false});
+			else if (node.is<luxem::array>())
+				for (auto &child : node.as<luxem::array>().get_data()) stack.push_back({&child, false});
+			continue;
+		}
+
+		feature_set features;
+		if (node.has_type()) features.structure |= type_feature(node.get_type());
+		if (node.is<luxem::primitive>()) features.literals |= literal_feature(node.as<luxem::primitive>().get_primitive());
+		else if (node.is<luxem::object>())
+		{
+			for (auto &child : node.as<luxem::object>().get_data())
+			{
+				features.structure |= key_feature(child.first);
+				features |= done.at(child.second.get());
+			}
+		}
+		else if (node.is<luxem::array>())
+			for (auto &child : node.as<luxem::array>().get_data()) features |= done.at(child.get());
+		done.emplace(&node, features);
+		if (!node.is<luxem::primitive>()) summaries.nodes.emplace(&node, subtree_summary{features, *current.node});
+	}
+}
+
+// Conservatively gets features every tree matched by pattern has
+feature_set pattern_features(luxem::value const &pattern, bool ignore_type = false, size_t depth = 0)
+{
+	feature_set out;
+	if (depth > disjoint_depth_limit) return out;
+	++depth;
+	if (pattern.is<match_definition_standin>())
+	{
+		auto &definition = pattern.as<match_definition_standin>();
+		if (definition && definition->pattern) out = pattern_features(*definition->pattern, ignore_type, depth);
+		return out;
+	}
+	if (pattern.is<alternate>())
+	{
+		auto &branches = pattern.as<alternate>().patterns;
+		if (branches.empty()) return out;
+		out = pattern_features(*branches.front(), ignore_type, depth);
+		for (auto &branch : branches) out &= pattern_features(*branch, ignore_type, depth);
+		return out;
+	}
+	if (pattern.is<type_regex>())
+	{
+		auto &value = pattern.as<type_regex>().value;
+		if (value) out = pattern_features(*value, true, depth);
+		return out;
+	}
+	if (pattern.is<sequence>())
+	{
+		for (auto &element : pattern.as<sequence>().run) out |= pattern_features(*element, false, depth);
+		return out;
+	}
+	if (pattern.is<partial>())
+	{
+		auto &keys = pattern.as<partial>().keys;
+		if (keys && keys->is<luxem::object>())
+			for (auto &pair : keys->as<luxem::object>().get_data())
+			{
+				out.structure |= key_feature(pair.first);
+				out |= pattern_features(*pair.second, false, depth);
+			}
+		return out;
+	}
+	if (pattern.is_derived<special>()) return out;
+
+	if (!ignore_type && pattern.has_type()) out.structure |= type_feature(pattern.get_type());
+	if (pattern.is<luxem::primitive>()) out.literals |= literal_feature(pattern.as<luxem::primitive>().get_primitive());
+	else if (pattern.is<luxem::object>())
+	{
+		for (auto &pair : pattern.as<luxem::object>().get_data())
+		{
+			out.structure |= key_feature(pair.first);
+			out |= pattern_features(*pair.second, false, depth);
+		}
+	}
+	else if (pattern.is<luxem::array>())
+		for (auto &element : pattern.as<luxem::array>().get_data()) out |= pattern_features(*element, false, depth);
+	return out;
+}
+
+// False if tree has a summary and it lacks features every match of the current transform needs
+bool may_contain_match(scan_context &context, luxem::value const &tree)
+{
+	if (!context.summaries) return true;
+	auto found = context.summaries->nodes.find(&tree);
+	if (found == context.summaries->nodes.end()) return true;
+	return found->second.features.contains(context.get_program().required);
+}
+
+// Called when a scan of tree finishes after modifying it, so later transforms don't trust its summary or hash
+void summary_invalidate(scan_context &context, luxem::value const &tree)
+{
+	if (context.summaries) context.summaries->nodes.erase(&tree);
+	if (context.hashes) context.hashes->erase(&tree);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// transform index
+
+size_t const index_minimum_transforms = 8;
+
+// A discrimination tree over the root of each transform's pattern, so one descent per node finds every
+// transform that could match there.  The first level is the node kind and the second the node's
+// tree_discriminator, each with a wildcard edge for patterns that don't fix it.
+struct luxemog::transform_index
+{
+	enum node_kind { kind_primitive, kind_object, kind_array, kind_count };
+	struct kind_edges
+	{
+		std::unordered_map<size_t, std::vector<size_t>> exact;
+		std::vector<size_t> any;
+	};
+	kind_edges kinds[kind_count];
+	std::vector<size_t> any;
+	size_t const count;
+
+	transform_index(size_t count) : count(count) {}
+
+	static bool kind_of(luxem::value const &tree, node_kind &out)
+	{
+		if (tree.is<luxem::primitive>()) out = kind_primitive;
+		else if (tree.is<luxem::object>()) out = kind_object;
+		else if (tree.is<luxem::array>()) out = kind_array;
+		else return false;
 		return true;
+	}
+
+	void add(luxem::value const *pattern, size_t transform, size_t depth = 0)
+	{
+		node_kind kind;
+		if (!pattern || (depth > disjoint_depth_limit)) any.push_back(transform);
+		else if (pattern->is<match_definition_standin>())
+		{
+			auto &definition = pattern->as<match_definition_standin>();
+			add(definition ? definition->pattern.get() : nullptr, transform, depth + 1);
+		}
+		else if (pattern->is<alternate>())
+		{
+			auto &branches = pattern->as<alternate>().patterns;
+			for (auto &branch : branches) add(branch.get(), transform, depth + 1);
+			if (branches.empty()) any.push_back(transform);
+		}
+		else if (pattern->is<regex>()) kinds[kind_primitive].any.push_back(transform);
+		else if (pattern->is<partial>()) kinds[kind_object].any.push_back(transform);
+		else if (pattern->is<sequence>()) kinds[kind_array].any.push_back(transform);
+		else if (pattern->is<type_regex>())
+		{
+			// The value is scanned ignoring its type, so only its kind is fixed
+			auto &value = pattern->as<type_regex>().value;
+			if (value && !value->is_derived<special>() && kind_of(*value, kind)) kinds[kind].any.push_back(transform);
+			else any.push_back(transform);
+		}
+		else if (pattern->is_derived<special>() || !kind_of(*pattern, kind)) any.push_back(transform);
+		else kinds[kind].exact[tree_discriminator(*pattern)].push_back(transform);
+	}
+
+	// Sets live to whether each transform could match some node in tree
+	void mark_live(luxem::value const &tree, std::vector<bool> &live) const
+	{
+		live.assign(count, false);
+		size_t remaining = count;
+		auto mark = [&](std::vector<size_t> const &transforms)
+		{
+			for (auto transform : transforms)
+			{
+				if (live[transform]) continue;
+				live[transform] = true;
+				--remaining;
+			}
+		};
+		mark(any);
+
+		std::vector<luxem::value const *> stack{&tree};
+		while (!stack.empty() && remaining)
+		{
+			auto &node = *stack.back();
+			stack.pop_back();
+			node_kind kind;
+			if (!kind_of(node, kind)) continue;
+			auto &edges = kinds[kind];
+			mark(edges.any);
+			auto found = edges.exact.find(tree_discriminator(node));
+			if (found != edges.exact.end()) mark(found->second);
+			if (kind == kind_object)
+				for (auto &child : node.as<luxem::object>().get_data()) stack.push_back(child.second.get());
+			else if (kind == kind_array)
+				for (auto &child : node.as<luxem::array>().get_data()) stack.push_back(child.get());
+		}
+	}
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// output sharing
+
+size_t const pool_minimum_sweep = 1024;
+unsigned int const pool_minimum_filter_bits = 16;
+
+// Hash-conses generated trees, so identical subtrees are one instance.  Containers leave the pool (or
+// are copied, if shared) while their children are scanned and rejoin afterwards.
+struct luxemog::output_pool
+{
+	struct pooled
+	{
+		size_t hash;
+		std::weak_ptr<luxem::value> node;
 	};
 
-	if (from->is<luxem::primitive>())
+	// A bit per address hash, set for every pooled container before it's placed in a tree, so scanning can
+	// skip the mutex for the many containers that were never pooled.  Bits are never cleared; sweeping
+	// replaces the filter instead.
+	struct filter
 	{
-		if (!check_type()) return step_fail;
-		if (!target->is<luxem::primitive>()) return step_fail;
-		auto &from_resolved = from->as<luxem::primitive>();
-		auto &target_resolved = target->as<luxem::primitive>();
-		if (target_resolved.get_primitive() != from_resolved.get_primitive()) return step_fail;
-		return step_break;
+		unsigned int const bits;
+		std::unique_ptr<std::atomic<uint64_t>[]> words;
+
+		filter(unsigned int bits) : bits(bits), words(new std::atomic<uint64_t>[(size_t(1) << bits) / 64]) 
+			{ for (size_t index = 0; index < (size_t(1) << bits) / 64; ++index) words[index] = 0; }
+
+		size_t position(luxem::value const *node) const
+			{ return (reinterpret_cast<uintptr_t>(node) * uint64_t(0x9E3779B97F4A7C15)) >> (64 - bits); }
+		void set(luxem::value const *node)
+			{ words[position(node) / 64].fetch_or(uint64_t(1) << (position(node) % 64), std::memory_order_relaxed); }
+		bool test(luxem::value const *node) const
+		{
+			return words[position(node) / 64].load(std::memory_order_relaxed) & 
+				(uint64_t(1) << (position(node) % 64));
+		}
+	};
+
+	std::mutex mutex;
+	std::unordered_multimap<size_t, std::weak_ptr<luxem::value>> nodes;
+	std::unordered_map<luxem::value const *, pooled> members;
+	size_t sweep_size = pool_minimum_sweep;
+
+	std::atomic<filter *> current_filter;
+	std::vector<std::unique_ptr<filter>> filters; // The current one and those retired while scans were running
+	std::atomic<size_t> scans{0};
+
+	output_pool(void)
+	{
+		filters.push_back(std::make_unique<filter>(pool_minimum_filter_bits));
+		current_filter = filters.back().get();
 	}
-	else if (from->is<luxem::object>())
+
+	// Counts a scan that may read the filter, until the result is released
+	std::shared_ptr<void> begin_scan(void)
 	{
-		if (!check_type()) return step_fail;
-		if (!target->is<luxem::object>()) return step_fail;
-		auto &from_resolved = from->as<luxem::object>();
-		auto &target_resolved = target->as<luxem::object>();
-		if (from_resolved.get_data().size() != target_resolved.get_data().size()) return step_fail;
-		context.stack.push_back(std::make_unique<object_scan_stackable>(
-			matches, 
-			target_resolved,
-			from_resolved));
-		return step_push;
+		++scans;
+		return std::shared_ptr<void>(this, [](void *pool) { --static_cast<output_pool *>(pool)->scans; });
 	}
-	else if (from->is<luxem::array>())
+
+	// False if node is certainly not pooled; doesn't lock.  Pooled nodes reach other threads' trees only
+	// through intern, under the mutex, after their bits are set.
+	bool may_be_pooled(luxem::value const &node) const
 	{
-		if (!check_type()) return step_fail;
-		if (!target->is<luxem::array>()) return step_fail;
-		auto &from_resolved = from->as<luxem::array>();
-		auto &target_resolved = target->as<luxem::array>();
-		if (from_resolved.get_data().size() != target_resolved.get_data().size()) return step_fail;
-		context.stack.push_back(std::make_unique<array_scan_stackable>(
-			matches, 
-			target_resolved,
-			from_resolved));
-		return step_push;
+		if (node.is<luxem::primitive>()) return false;
+		return current_filter.load()->test(&node);
+	}
+
+	pooled const *find_member(luxem::value const &node)
+	{
+		auto found = members.find(&node);
+		if (found == members.end()) return nullptr;
+		if (found->second.node.lock().get() != &node) return nullptr;
+		return &found->second;
+	}
+
+	// Children are pooled already, so they're compared by identity
+	static bool equal(luxem::value const &first, luxem::value const &second)
+	{
+		if (first.has_type() != second.has_type()) return false;
+		if (first.has_type() && (first.get_type() != second.get_type())) return false;
+		if (first.is<luxem::primitive>())
+		{
+			return second.is<luxem::primitive>() && 
+				first.as<luxem::primitive>().get_primitive() == second.as<luxem::primitive>().get_primitive();
+		}
+		else if (first.is<luxem::object>())
+		{
+			if (!second.is<luxem::object>()) return false;
+			auto &first_data = first.as<luxem::object>().get_data();
+			auto &second_data = second.as<luxem::object>().get_data();
+			if (first_data.size() != second_data.size()) return false;
+			return std::equal(first_data.begin(), first_data.end(), second_data.begin(), 
+				[](auto const &left, auto const &right)
+					{ return left.first == right.first && left.second == right.second; });
+		}
+		else if (first.is<luxem::array>())
+		{
+			if (!second.is<luxem::array>()) return false;
+			auto &first_data = first.as<luxem::array>().get_data();
+			auto &second_data = second.as<luxem::array>().get_data();
+			return first_data.size() == second_data.size() &&
+				std::equal(first_data.begin(), first_data.end(), second_data.begin());
+		}
+		return false;
+	}
+
+	void sweep(void)
+	{
+		for (auto iterator = nodes.begin(); iterator != nodes.end();)
+		{
+			if (iterator->second.expired()) iterator = nodes.erase(iterator);
+			else ++iterator;
+		}
+		for (auto iterator = members.begin(); iterator != members.end();)
+		{
+			if (iterator->second.node.expired()) iterator = members.erase(iterator);
+			else ++iterator;
+		}
+		sweep_size = std::max(pool_minimum_sweep, nodes.size() * 2);
+
+		// Rebuild the filter without the bits of expired members.  Only intern sweeps, during a scan, so if
+		// that's the only scan running no one else can still be reading a retired filter.
+		unsigned int bits = pool_minimum_filter_bits;
+		while ((size_t(1) << bits) < members.size() * 16) ++bits;
+		filters.push_back(std::make_unique<filter>(bits));
+		for (auto &member : members) filters.back()->set(member.first);
+		current_filter = filters.back().get();
+		if (scans <= 1) filters.erase(filters.begin(), std::prev(filters.end()));
+	}
+
+	// Replaces each subtree of root with an identical pooled instance, pooling those that are new
+	void intern(std::shared_ptr<luxem::value> &root)
+	{
+		static std::hash<std::string> const hash_string;
+		std::lock_guard<std::mutex> guard(mutex);
+		struct pending { std::shared_ptr<luxem::value> *node; bool children_done; };
+		std::vector<pending> stack{{&root, false}};
+		while (!stack.empty())
+		{
+			auto current = stack.back();
+			stack.pop_back();
+			auto &node = **current.node;
+			if (find_member(node)) continue;
+
+			if (!current.children_done)
+			{
+				stack.push_back({current.node, true});
+				if (node.is<luxem::object>())
+					for (auto &child : node.as<luxem::object>().get_data()) stack.push_back({&child.second, false});
+				else if (node.is<luxem::array>())
+					for (auto &child : node.as<luxem::array>().get_data()) stack.push_back({&child, false});
+				continue;
+			}
+
+			size_t hash = tree_discriminator(node);
+			if (node.is<luxem::object>())
+			{
+				for (auto &child : node.as<luxem::object>().get_data())
+				{
+					hash = discriminator_combine(hash, hash_string(child.first));
+					hash = discriminator_combine(hash, find_member(*child.second)->hash);
+				}
+			}
+			else if (node.is<luxem::array>())
+			{
+				for (auto &child : node.as<luxem::array>().get_data())
+					hash = discriminator_combine(hash, find_member(*child)->hash);
+			}
+
+			bool found = false;
+			auto range = nodes.equal_range(hash);
+			for (auto candidate = range.first; candidate != range.second; ++candidate)
+			{
+				auto existing = candidate->second.lock();
+				if (!existing || !equal(*existing, node)) continue;
+				*current.node = std::move(existing);
+				found = true;
+				break;
+			}
+			if (found) continue;
+			current_filter.load()->set(&node);
+			nodes.emplace(hash, *current.node);
+			members[&node] = pooled{hash, *current.node};
+		}
+		if (nodes.size() > sweep_size) sweep();
+	}
+
+	// Makes root safe to modify the children of: copies it if it's shared, otherwise stops pooling it.
+	// Returns true if root was pooled.
+	bool unshare(std::shared_ptr<luxem::value> &root)
+	{
+		if (!may_be_pooled(*root)) return false;
+		std::lock_guard<std::mutex> guard(mutex);
+		auto member = find_member(*root);
+		if (!member) return false;
+		if (root.use_count() == 1)
+		{
+			auto range = nodes.equal_range(member->hash);
+			for (auto candidate = range.first; candidate != range.second; ++candidate)
+			{
+				if (candidate->second.lock() != root) continue;
+				nodes.erase(candidate);
+				break;
+			}
+			members.erase(root.get());
+			return true;
+		}
+		std::shared_ptr<luxem::value> copy;
+		if (root->is<luxem::object>())
+		{
+			auto out = std::make_shared<luxem::object>();
+			out->get_data() = root->as<luxem::object>().get_data();
+			copy = out;
+		}
+		else
+		{
+			auto out = std::make_shared<luxem::array>();
+			out->get_data() = root->as<luxem::array>().get_data();
+			copy = out;
+		}
+		if (root->has_type()) copy->set_type(root->get_type());
+		root = std::move(copy);
+		return true;
+	}
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// profiling
+
+// Samples are keyed by the path of transforms and pattern nodes scanned, labeled only when written
+struct luxemog::transform_profile
+{
+	std::mutex mutex;
+	std::map<std::vector<void const *>, profile_sample> samples;
+
+	void merge(std::map<std::vector<void const *>, profile_sample> const &more)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		for (auto &pair : more)
+		{
+			auto &sample = samples[pair.first];
+			sample.nanoseconds += pair.second.nanoseconds;
+			sample.attempts += pair.second.attempts;
+		}
+	}
+};
+
+// Names transforms and pattern nodes for folded stack frames
+struct profile_labels
+{
+	std::unordered_map<void const *, std::string> labels;
+
+	// Folded stack frames can't contain ';' and the count follows the last space
+	static std::string clean(std::string text)
+	{
+		for (auto &character : text) if ((character == ';') || (character == '\n')) character = '_';
+		return text;
+	}
+
+	std::string const &get(void const *node) const
+	{
+		static std::string const unknown("?");
+		auto found = labels.find(node);
+		if (found == labels.end()) return unknown;
+		return found->second;
+	}
+
+	void label_transform(luxemog::transform::transform_data const &data, std::string const &name)
+	{
+		labels.emplace(&data, name);
+		for (auto reverse : {false, true})
+		{
+			// Scans use the programs' patterns, which the optimizer may have replaced
+			auto &program = data.programs[reverse];
+			if (program && program->match) label_pattern(*program->match, reverse ? "to" : "from");
+		}
+		if (data.from) label_pattern(*data.from, "from");
+		if (data.to) label_pattern(*data.to, "to");
+		size_t index = 0;
+		for (auto &subtransform : data.subtransforms)
+		{
+			std::stringstream subname;
+			subname << "subtransform " << index++;
+			label_transform(*subtransform, subname.str());
+		}
+	}
+
+	// edge says how the node is reached from its parent
+	void label_pattern(luxem::value const &pattern, std::string const &edge)
+	{
+		std::string kind;
+		if (pattern.is<luxem::primitive>()) kind = "primitive";
+		else if (pattern.is<luxem::object>()) kind = "object";
+		else if (pattern.is<luxem::array>()) kind = "array";
+		else kind = pattern.get_name();
+		if (!labels.emplace(&pattern, clean(edge + " " + kind)).second) return;
+
+		auto label_array = [this](std::vector<std::shared_ptr<luxem::value>> const &elements)
+		{
+			for (size_t index = 0; index < elements.size(); ++index)
+			{
+				std::stringstream element_edge;
+				element_edge << "[" << index << "]";
+				label_pattern(*elements[index], element_edge.str());
+			}
+		};
+		if (pattern.is<luxem::object>())
+			for (auto &pair : pattern.as<luxem::object>().get_data()) label_pattern(*pair.second, pair.first);
+		else if (pattern.is<luxem::array>()) label_array(pattern.as<luxem::array>().get_data());
+		else if (pattern.is<match_definition_standin>())
+		{
+			auto &definition = pattern.as<match_definition_standin>();
+			if (definition && definition->pattern) 
+				label_pattern(*definition->pattern, definition->id ? *definition->id : std::string("match"));
+		}
+		else if (pattern.is<alternate>())
+		{
+			auto &branches = pattern.as<alternate>().patterns;
+			for (size_t index = 0; index < branches.size(); ++index)
+			{
+				std::stringstream branch_edge;
+				branch_edge << "branch " << index;
+				label_pattern(*branches[index], branch_edge.str());
+			}
+		}
+		else if (pattern.is<type_regex>())
+		{
+			auto &value = pattern.as<type_regex>().value;
+			if (value) label_pattern(*value, "value");
+		}
+		else if (pattern.is<sequence>()) label_array(pattern.as<sequence>().run);
+		else if (pattern.is<partial>())
+		{
+			auto &keys = pattern.as<partial>().keys;
+			if (keys && keys->is<luxem::object>())
+				for (auto &pair : keys->as<luxem::object>().get_data()) label_pattern(*pair.second, pair.first);
+		}
+	}
+};
+
+void profile_begin(scan_context &context, luxem::value const &pattern)
+{
+	context.profile_frames.push_back(profile_frame{&pattern, std::chrono::steady_clock::now(), 0});
+}
+
+// Attributes the time since the innermost frame began, less its children's, to the frame's stack
+void profile_end(scan_context &context)
+{
+	auto frame = context.profile_frames.back();
+	context.profile_frames.pop_back();
+	uint64_t total = std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now() - frame.start).count();
+	if (!context.profile_frames.empty()) context.profile_frames.back().child_nanoseconds += total;
+
+	std::vector<void const *> key(context.transform_stack.begin(), context.transform_stack.end());
+	for (auto &parent : context.profile_frames) key.push_back(parent.pattern);
+	key.push_back(frame.pattern);
+	auto &sample = context.profile_samples[key];
+	sample.nanoseconds += total > frame.child_nanoseconds ? total - frame.child_nanoseconds : 0;
+	sample.attempts += 1;
+}
+
+// Sits below a profiled pattern node's stackables to see when its scan finishes
+struct profile_scan_stackable : scan_stackable
+{
+	step_result step(scan_context &context, step_result last_result) override
+	{
+		profile_end(context);
+		return last_result;
+	}
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// scanning
+
+std::unique_ptr<scan_stackable> make_scan_root(
+	scan_context &context,
+	std::shared_ptr<luxem::value> &root, 
+	luxemog::traversal_order traversal, 
+	scope_state scope, 
+	bool memoize);
+
+std::unique_ptr<scan_stackable> make_fused_scan(
+	scan_context &context,
+	std::shared_ptr<luxem::value> &root, 
+	std::vector<luxemog::transform::transform_data const *> const &stage);
+
+struct scan_root_stackable : scan_stackable
+{
+	std::shared_ptr<luxem::value> &root;
+	luxemog::traversal_order const traversal;
+	scope_state const scope;
+	bool memoize; // False once subtransforms may have modified the original children
+	bool repool; // Root was taken out of the output pool to scan its children
+	size_t const replacements; // context.replacements when created, to detect changes under root
+
+	struct substackable
+	{
+		std::function<step_result(scan_context &context, step_result last_result, std::unique_ptr<substackable> &next_state)> callback;
+		template <typename callback_type> substackable(callback_type &&callback) : callback(std::move(callback)) {}
+		step_result step(scan_context &context, step_result last_result, std::unique_ptr<substackable> &next_state)
+			{ return callback(context, last_result, next_state); }
+	};
+
+	// Scans each child of root that may be in scope, then either scans root (then_scan) or finishes
+	step_result begin_recurse(scan_context &context, std::unique_ptr<substackable> &next_state, bool then_scan)
+	{
+		if (context.pool && context.pool->unshare(root)) repool = true;
+		if (root->is<luxem::object>())
+		{
+			auto &data = root->as<luxem::object>().get_data();
+			auto temp = std::move(next_state);
+			next_state = std::make_unique<substackable>(
+				[this, &data, then_scan, iterator = data.begin()](
+					scan_context &context, 
+					step_result last_result, 
+					std::unique_ptr<substackable> &next_state) mutable
+				{
+					while (iterator != data.end())
+					{
+						auto &child = iterator->second;
+						auto child_scope = scope_advance(
+							*context.transform_stack.back(), scope, &iterator->first, 0, *child);
+						++iterator;
+						if (!child_scope || !may_contain_match(context, *child)) continue;
+						context.stack.push_back(make_scan_root(context, child, traversal, child_scope, memoize));
+						return step_push;
+					}
+					return then_scan ? begin_scan(next_state) : step_break;
+				});
+		}
+		else if (root->is<luxem::array>())
+		{
+			auto &data = root->as<luxem::array>().get_data();
+			auto temp = std::move(next_state);
+			next_state = std::make_unique<substackable>(
+				[this, &data, then_scan, iterator = data.begin()](
+					scan_context &context, 
+					step_result last_result, 
+					std::unique_ptr<substackable> &next_state) mutable
+				{
+					while (iterator != data.end())
+					{
+						auto &child = *iterator;
+						auto child_scope = scope_advance(
+							*context.transform_stack.back(), scope, nullptr, iterator - data.begin(), *child);
+						++iterator;
+						if (!child_scope || !may_contain_match(context, *child)) continue;
+						context.stack.push_back(make_scan_root(context, child, traversal, child_scope, memoize));
+						return step_push;
+					}
+					return then_scan ? begin_scan(next_state) : step_break;
+				});
+		}
+		else return then_scan ? begin_scan(next_state) : step_break;
+		return step_continue;
+	}
+	
+	step_result begin_subtransform(scan_context &context, std::unique_ptr<substackable> &next_state)
+	{
+		auto &stages = context.get_program().stages;
+		if (!stages.empty()) memoize = false;
+		auto temp = std::move(next_state);
+		next_state = std::make_unique<substackable>(
+			[this, &stages, stage = stages.begin(), pushed = false](
+				scan_context &context, 
+				step_result last_result, 
+				std::unique_ptr<substackable> &next_state) mutable
+			{
+				if (pushed)
+				{
+					context.transform_stack.pop_back();
+					pushed = false;
+				}
+				if (stage == stages.end()) 
+				{
+					// Only reenter the (possibly replaced) root when the traversal allows it
+					if (traversal != luxemog::traverse_reenter) return step_break;
+					return begin_recurse(context, next_state, false);
+				}
+				if (stage->size() > 1) context.stack.push_back(make_fused_scan(context, root, *stage));
+				else
+				{
+					auto data = stage->front();
+					context.transform_stack.push_back(data);
+					pushed = true;
+					context.stack.push_back(make_scan_root(context, root, data->traversal, scope_start(*data), false));
+				}
+				++stage;
+				return step_push;
+			});
+		return step_continue;
+	}
+
+	step_result begin_scan(std::unique_ptr<substackable> &next_state)
+	{
+		auto temp = std::move(next_state);
+		next_state = std::make_unique<substackable>(
+			[this, matches = match_map(), started = false](
+				scan_context &context, 
+				step_result last_result, 
+				std::unique_ptr<substackable> &next_state) mutable
+			{
+				// Start by scanning root
+				if (!started)
+				{
+					started = true;
+					if (!(scope & scope_inside))
+					{
+						// Outside scope, only descend towards it
+						if (traversal == luxemog::traverse_bottom_up) return step_break;
+						return begin_recurse(context, next_state, false);
+					}
+					if (context.verbose) 
+						std::cerr << "Scanning " << this->root->get_name() << std::endl;
+					last_result = scan_node(context, matches, this->root, context.get_program().match);
+					if (last_result == step_push) return step_push;
+				}
+
+				// Scan finished, transform if successful
+				if (last_result == step_fail) 
+				{
+					if (context.verbose) 
+						std::cerr << "Failed to match " << this->root->get_name() << std::endl;
+				}
+				else
+				{
+					if (context.verbose) 
+						std::cerr << "Matched " << this->root->get_name() << std::endl;
+					auto &generate = context.get_program().generate;
+					if (generate)
+					{
+						transform_root(matches, this->root, generate, context.verbose);
+						if (context.pool) context.pool->intern(this->root);
+						++context.replacements;
+					}
+					return begin_subtransform(context, next_state);
+				}
+
+				// Children were already scanned if bottom up
+				if (traversal == luxemog::traverse_bottom_up) return step_break;
+				return begin_recurse(context, next_state, false);
+			});
+		return step_continue;
+	}
+
+	std::unique_ptr<substackable> state;
+
+	scan_root_stackable(
+		std::shared_ptr<luxem::value> &root, 
+		luxemog::traversal_order traversal, 
+		scope_state scope, 
+		bool memoize,
+		size_t replacements) : 
+		root(root), 
+		traversal(traversal),
+		scope(scope),
+		memoize(memoize),
+		repool(false),
+		replacements(replacements)
+	{
+		if (traversal == luxemog::traverse_bottom_up)
+		{
+			state = std::make_unique<substackable>(
+				[this](
+					scan_context &context, 
+					step_result last_result, 
+					std::unique_ptr<substackable> &next_state)
+					{ return begin_recurse(context, next_state, true); });
+		}
+		else begin_scan(state);
+	}
+
+	step_result step(scan_context &context, step_result last_result) override
+	{ 
+		auto result = state->callback(context, last_result, state); 
+		if (result == step_break || result == step_fail)
+		{
+			if (context.replacements != replacements) summary_invalidate(context, *root);
+			if (repool) context.pool->intern(root);
+		}
+		return result;
+	}
+};
+
+// Reuses the outcome of scanning an identical subtree if there is one, otherwise scans and saves it
+struct memo_scan_stackable : scan_stackable
+{
+	std::shared_ptr<luxem::value> &root;
+	luxemog::traversal_order const traversal;
+	scope_state const scope;
+	luxemog::transform_memo::key const id;
+	size_t replacements;
+
+	memo_scan_stackable(
+		std::shared_ptr<luxem::value> &root, 
+		luxemog::traversal_order traversal, 
+		scope_state scope, 
+		luxemog::transform_memo::key const &id) :
+		root(root),
+		traversal(traversal),
+		scope(scope),
+		id(id),
+		replacements(0)
+		{}
+
+	static std::shared_ptr<luxem::value> copy(std::shared_ptr<luxem::value> const &tree)
+	{
+		match_map none;
+		std::shared_ptr<luxem::value> out;
+		transform_root(none, out, tree, false);
+		return out;
+	}
+
+	step_result step(scan_context &context, step_result last_result) override
+	{
+		if (last_result == step_push)
+		{
+			bool changed;
+			std::shared_ptr<luxem::value> output;
+			if (context.memo->find(id, changed, output))
+			{
+				if (context.verbose) 
+					std::cerr << "Reusing memoized result for " << root->get_name() << std::endl;
+				if (changed)
+				{
+					context.hashes->erase(root.get());
+					root = copy(output);
+					if (context.pool) context.pool->intern(root);
+					++context.replacements;
+				}
+				return step_break;
+			}
+			replacements = context.replacements;
+			context.stack.push_back(
+				std::make_unique<scan_root_stackable>(root, traversal, scope, true, context.replacements));
+			return step_push;
+		}
+
+		bool changed = context.replacements != replacements;
+		context.memo->store(id, changed, changed ? copy(root) : nullptr);
+		return step_break;
+	}
+};
+
+// Applies a stage of fused subtransforms in one pre-order, reentering traversal, trying each in turn at every
+// node.  Only subtransforms without scopes or subtransforms of their own are fused; see fusable.
+struct fused_scan_stackable : scan_stackable
+{
+	std::shared_ptr<luxem::value> &root;
+	std::vector<luxemog::transform::transform_data const *> const &stage;
+	size_t const replacements; // context.replacements when created, to detect changes under root
+	size_t member = 0; // Next member to scan root with
+	bool scanning = false; // A member is on the transform stack, waiting for its scan to finish
+	match_map matches;
+	bool recursing = false;
+	bool repool = false; // Root was taken out of the output pool to scan its children
+	std::vector<std::shared_ptr<luxem::value> *> children;
+	size_t child = 0;
+
+	fused_scan_stackable(
+		std::shared_ptr<luxem::value> &root, 
+		std::vector<luxemog::transform::transform_data const *> const &stage,
+		size_t replacements) :
+		root(root),
+		stage(stage),
+		replacements(replacements)
+		{}
+
+	void finish_member(scan_context &context, step_result result)
+	{
+		if (result == step_fail) 
+		{
+			if (context.verbose) std::cerr << "Failed to match " << root->get_name() << std::endl;
+		}
+		else
+		{
+			if (context.verbose) std::cerr << "Matched " << root->get_name() << std::endl;
+			auto &generate = context.get_program().generate;
+			if (generate)
+			{
+				transform_root(matches, root, generate, context.verbose);
+				if (context.pool) context.pool->intern(root);
+				++context.replacements;
+			}
+		}
+		context.transform_stack.pop_back();
+		scanning = false;
+		++member;
+	}
+
+	bool any_may_contain_match(scan_context &context, luxem::value const &tree)
+	{
+		for (auto data : stage)
+		{
+			context.transform_stack.push_back(data);
+			bool out = may_contain_match(context, tree);
+			context.transform_stack.pop_back();
+			if (out) return true;
+		}
+		return false;
+	}
+
+	step_result step(scan_context &context, step_result last_result) override
+	{
+		if (scanning) finish_member(context, last_result);
+		while (member < stage.size())
+		{
+			context.transform_stack.push_back(stage[member]);
+			if (!may_contain_match(context, *root))
+			{
+				context.transform_stack.pop_back();
+				++member;
+				continue;
+			}
+			if (context.verbose) std::cerr << "Scanning " << root->get_name() << std::endl;
+			matches = match_map();
+			scanning = true;
+			auto result = scan_node(context, matches, root, context.get_program().match);
+			if (result == step_push) return step_push;
+			finish_member(context, result);
+		}
+
+		// Then every member's children, including those of replacements
+		if (!recursing)
+		{
+			recursing = true;
+			if (context.pool && context.pool->unshare(root)) repool = true;
+			if (root->is<luxem::object>())
+				for (auto &pair : root->as<luxem::object>().get_data()) children.push_back(&pair.second);
+			else if (root->is<luxem::array>())
+				for (auto &element : root->as<luxem::array>().get_data()) children.push_back(&element);
+		}
+		while (child < children.size())
+		{
+			auto &next = *children[child++];
+			if (!any_may_contain_match(context, *next)) continue;
+			context.stack.push_back(make_fused_scan(context, next, stage));
+			return step_push;
+		}
+
+		if (context.replacements != replacements) summary_invalidate(context, *root);
+		if (repool) context.pool->intern(root);
+		return step_break;
+	}
+};
+
+std::unique_ptr<scan_stackable> make_fused_scan(
+	scan_context &context,
+	std::shared_ptr<luxem::value> &root, 
+	std::vector<luxemog::transform::transform_data const *> const &stage)
+	{ return std::make_unique<fused_scan_stackable>(root, stage, context.replacements); }
+
+std::unique_ptr<scan_stackable> make_scan_root(
+	scan_context &context,
+	std::shared_ptr<luxem::value> &root, 
+	luxemog::traversal_order traversal, 
+	scope_state scope, 
+	bool memoize)
+{
+	// Only subtrees of the original document are hashed, and subtransforms see modified trees
+	if (memoize && context.memo && context.transform_stack.size() == 1)
+	{
+		auto found = context.hashes->find(root.get());
+		if (found != context.hashes->end())
+		{
+			return std::make_unique<memo_scan_stackable>(
+				root, 
+				traversal, 
+				scope, 
+				luxemog::transform_memo::key{
+					context.transform_stack.back(), context.reverse, scope, found->second.digest});
+		}
+	}
+	return std::make_unique<scan_root_stackable>(root, traversal, scope, memoize, context.replacements);
+}
+
+struct object_scan_stackable : scan_stackable
+{
+	match_map &matches;
+	luxem::object &target;
+	luxem::object const &from;
+
+	// Both objects have the same size and are sorted by key, so they match key for key in order, without
+	// looking up each key in target
+	luxem::object::object_data::iterator target_iterator;
+	luxem::object::object_data::const_iterator iterator;
+
+	object_scan_stackable(match_map &matches, luxem::object &target, luxem::object const &from) :
+		matches(matches),
+		target(target),
+		from(from),
+		target_iterator(target.get_data().begin()),
+		iterator(from.get_data().begin())
+		{}
+
+	step_result step(scan_context &context, step_result last_result) override
+	{
+		// Elements that match immediately are followed by the next rather than finishing the scan
+		while (true)
+		{
+			if (last_result == step_fail) return step_fail;
+			if (iterator == from.get_data().end()) return step_break;
+			if (target_iterator->first != iterator->first) return step_fail;
+			last_result = scan_node(context, matches, target_iterator->second, iterator->second);
+			++target_iterator;
+			++iterator;
+			if (last_result == step_push) return step_push;
+		}
+	}
+};
+
+struct array_scan_stackable : scan_stackable
+{
+	match_map &matches;
+	luxem::array &target;
+	luxem::array const &from;
+
+	luxem::array::array_data::iterator target_iterator;
+	luxem::array::array_data::const_iterator from_iterator;
+
+	array_scan_stackable(match_map &matches, luxem::array &target, luxem::array const &from) :
+		matches(matches),
+		target(target),
+		from(from),
+		target_iterator(target.get_data().begin()),
+		from_iterator(from.get_data().begin())
+		{}
+
+	step_result step(scan_context &context, step_result last_result) override
+	{
+		while (true)
+		{
+			if (last_result == step_fail) return step_fail;
+			if (from_iterator == from.get_data().end()) return step_break;
+			last_result = scan_node(context, matches, *target_iterator, *from_iterator);
+			++target_iterator;
+			++from_iterator;
+			if (last_result == step_push) return step_push;
+		}
+	}
+};
+
+step_result scan_node_unprofiled(
+	scan_context &context, 
+	match_map &matches, 
+	std::shared_ptr<luxem::value> &target,
+	std::shared_ptr<luxem::value> const &from,
+	bool ignore_type)
+{
+	if (context.verbose) std::cerr << "Comparing " << target->get_name() << " to " << from->get_name() << std::endl;
+
+	// Types, keys and primitives are compared as strings.  Interning them on the pattern side alone can't
+	// skip that: targets hold their own copies, so a cached hash would need the target's string hashed
+	// first, and string equality already rejects differing lengths before comparing any characters.
+	auto check_type = [&](void)
+	{
+		if (ignore_type) return true;
+		if (target->has_type() != from->has_type()) return false;
+		if (from->has_type() && (target->get_type() != from->get_type())) return false;
+		return true;
+	};
+
+	if (from->is<luxem::primitive>())
+	{
+		if (!check_type()) return step_fail;
+		if (!target->is<luxem::primitive>()) return step_fail;
+		auto &from_resolved = from->as<luxem::primitive>();
+		auto &target_resolved = target->as<luxem::primitive>();
+		if (target_resolved.get_primitive() != from_resolved.get_primitive()) return step_fail;
+		return step_break;
+	}
+	else if (from->is<luxem::object>())
+	{
+		if (!check_type()) return step_fail;
+		if (!target->is<luxem::object>()) return step_fail;
+		auto &from_resolved = from->as<luxem::object>();
+		auto &target_resolved = target->as<luxem::object>();
+		if (from_resolved.get_data().size() != target_resolved.get_data().size()) return step_fail;
+		context.stack.push_back(std::make_unique<object_scan_stackable>(
+			matches, 
+			target_resolved,
+			from_resolved));
+		return step_push;
+	}
+	else if (from->is<luxem::array>())
+	{
+		if (!check_type()) return step_fail;
+		if (!target->is<luxem::array>()) return step_fail;
+		auto &from_resolved = from->as<luxem::array>();
+		auto &target_resolved = target->as<luxem::array>();
+		if (from_resolved.get_data().size() != target_resolved.get_data().size()) return step_fail;
+		context.stack.push_back(std::make_unique<array_scan_stackable>(
+			matches, 
+			target_resolved,
+			from_resolved));
+		return step_push;
+	}
+	else if (from->is_derived<special>())
+	{
+		return from->as_derived<special>().scan(context, matches, target);
+	}
+	else
+	{
+		assert(false);
+		return step_fail;
+	}
+}
+
+step_result scan_node(
+	scan_context &context, 
+	match_map &matches, 
+	std::shared_ptr<luxem::value> &target,
+	std::shared_ptr<luxem::value> const &from,
+	bool ignore_type)
+{
+	if (!context.profile) return scan_node_unprofiled(context, matches, target, from, ignore_type);
+	profile_begin(context, *from);
+	// Emitting scans nodes directly, with nothing on the stack yet
+	bool const root = context.stack.empty();
+	auto caller = root ? context.stack.end() : std::prev(context.stack.end());
+	auto result = scan_node_unprofiled(context, matches, target, from, ignore_type);
+	if (result != step_push)
+	{
+		profile_end(context);
+		return result;
+	}
+	context.stack.insert(
+		root ? context.stack.begin() : std::next(caller), 
+		std::make_unique<profile_scan_stackable>());
+	return step_push;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// transforming
+
+struct object_transform_stackable : transform_stackable
+{
+	std::shared_ptr<luxem::object> out;
+	luxem::object const &to;
+
+	luxem::object::object_data::const_iterator to_iterator;
+
+	object_transform_stackable(std::shared_ptr<luxem::object> out, luxem::object const &to) : 
+		out(out), 
+		to(to), 
+		to_iterator(to.get_data().begin()) 
+		{}
+
+	bool step(transform_context &context, match_map &matches) override
+	{
+		if (to_iterator == to.get_data().end()) return false;
+		if (to_iterator->second->is<rest>())
+		{
+			// Splice the saved elements, ignoring the key
+			auto &saved = to_iterator->second->as<rest>().splice<luxem::object>(matches);
+			for (auto &pair : saved) out->get_data().emplace(pair.first, transform_node(context, matches, pair.second));
+		}
+		else out->get_data().emplace(to_iterator->first, transform_node(context, matches, to_iterator->second));
+		++to_iterator;
+		return true;
+	}
+};
+
+struct array_transform_stackable : transform_stackable
+{
+	std::shared_ptr<luxem::array> out;
+	luxem::array const &to;
+
+	luxem::array::array_data::const_iterator to_iterator;
+
+	array_transform_stackable(std::shared_ptr<luxem::array> out, luxem::array const &to) : 
+		out(out), 
+		to(to), 
+		to_iterator(to.get_data().begin()) 
+		{}
+
+	bool step(transform_context &context, match_map &matches) override
+	{
+		if (to_iterator == to.get_data().end()) return false;
+		if ((*to_iterator)->is<rest>())
+		{
+			// Splice the saved elements
+			auto &saved = (*to_iterator)->as<rest>().splice<luxem::array>(matches);
+			for (auto &element : saved) out->get_data().emplace_back(transform_node(context, matches, element));
+		}
+		else out->get_data().emplace_back(transform_node(context, matches, *to_iterator));
+		++to_iterator;
+		return true;
+	}
+};
+
+std::shared_ptr<luxem::value> transform_node(
+	transform_context &context, 
+	match_map const &matches, 
+	std::shared_ptr<luxem::value> const &to)
+{
+	if (to->is<luxem::primitive>())
+	{
+		auto out = std::make_shared<luxem::primitive>(to->as<luxem::primitive>().get_primitive());
+		if (to->has_type()) out->set_type(to->get_type());
+		return out;
+	}
+	else if (to->is<luxem::object>())
+	{
+		auto out = std::make_shared<luxem::object>();
+		if (to->has_type()) out->set_type(to->get_type());
+		context.stack.emplace_back(std::make_unique<object_transform_stackable>(out, to->as<luxem::object>()));
+		return out;
+	}
+	else if (to->is<luxem::array>())
+	{
+		auto out = std::make_shared<luxem::array>();
+		if (to->has_type()) out->set_type(to->get_type());
+		context.stack.emplace_back(std::make_unique<array_transform_stackable>(out, to->as<luxem::array>()));
+		return out;
+	}
+	else if (to->is_derived<special>())
+	{
+		return to->as_derived<special>().generate(context, matches);
+	}
+	else
+	{
+		assert(false);
+		return {};
+	}
+}
+
+void transform_root(
+	match_map &matches, 
+	std::shared_ptr<luxem::value> &root,
+	std::shared_ptr<luxem::value> const &to,
+	bool verbose)
+{
+	transform_context context{verbose};
+	auto out = transform_node(context, matches, to);
+	while (!context.stack.empty()) 
+		if (!context.stack.back()->step(context, matches))
+			context.stack.pop_back();
+	// Replaced last, since saved strings may point into the old root
+	root = std::move(out);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// programs
+// Each direction of a transform gets its own program, compiled when the transform finishes loading, so
+// nothing at run time depends on which of 'from' and 'to' is matching.  Compiling checks that every
+// special in a pattern works in that pattern's role.
+
+// Finds a special in pattern that can't be used in its role, or returns null
+luxem::value const *misplaced_special(
+	luxem::value const &pattern, 
+	bool generating, 
+	std::unordered_set<luxem::value const *> &seen)
+{
+	if (!seen.insert(&pattern).second) return nullptr;
+	auto check = [&](std::shared_ptr<luxem::value> const &child) -> luxem::value const *
+		{ return child ? misplaced_special(*child, generating, seen) : nullptr; };
+	auto check_all = [&](std::vector<std::shared_ptr<luxem::value>> const &children) -> luxem::value const *
+	{
+		for (auto &child : children) if (auto found = check(child)) return found;
+		return nullptr;
+	};
+
+	if (pattern.is<luxem::object>())
+	{
+		for (auto &pair : pattern.as<luxem::object>().get_data()) if (auto found = check(pair.second)) return found;
+		return nullptr;
+	}
+	if (pattern.is<luxem::array>()) return check_all(pattern.as<luxem::array>().get_data());
+
+	if (generating)
+	{
+		if (pattern.is<build_type>()) return check(pattern.as<build_type>().value);
+		if (pattern.is<regex>() || pattern.is<type_regex>() || pattern.is<alternate>() || 
+			pattern.is<wildcard>() || pattern.is<sequence>() || pattern.is<partial>()) 
+			return &pattern;
+		return nullptr;
+	}
+
+	if (pattern.is<match_definition_standin>())
+	{
+		auto &definition = pattern.as<match_definition_standin>();
+		return definition ? check(definition->pattern) : nullptr;
+	}
+	if (pattern.is<alternate>()) return check_all(pattern.as<alternate>().patterns);
+	if (pattern.is<type_regex>()) return check(pattern.as<type_regex>().value);
+	if (pattern.is<sequence>()) return check_all(pattern.as<sequence>().run);
+	if (pattern.is<partial>()) return check(pattern.as<partial>().keys);
+	if (pattern.is<build_type>() || pattern.is<build_string>() || pattern.is<error>() || pattern.is<rest>()) 
+		return &pattern;
+	return nullptr;
+}
+
+enum rest_kind { rest_array = 1, rest_object = 2 };
+
+// Collects the ids of rests match captures, with the rest_kinds of what each can be captured from, an array
+// by *seq or an object by *partial
+void captured_rests(
+	luxem::value const &match, 
+	std::unordered_map<symbol, int> &out, 
+	std::unordered_set<luxem::value const *> &seen)
+{
+	if (!seen.insert(&match).second) return;
+	auto collect = [&](std::shared_ptr<luxem::value> const &child) 
+		{ if (child) captured_rests(*child, out, seen); };
+
+	if (match.is<luxem::object>())
+		for (auto &pair : match.as<luxem::object>().get_data()) collect(pair.second);
+	else if (match.is<luxem::array>())
+		for (auto &element : match.as<luxem::array>().get_data()) collect(element);
+	else if (match.is<match_definition_standin>())
+	{
+		auto &definition = match.as<match_definition_standin>();
+		if (definition) collect(definition->pattern);
+	}
+	else if (match.is<alternate>())
+		for (auto &pattern : match.as<alternate>().patterns) collect(pattern);
+	else if (match.is<type_regex>()) collect(match.as<type_regex>().value);
+	else if (match.is<sequence>())
+	{
+		auto &resolved = match.as<sequence>();
+		if (resolved.before) out[resolved.before] |= rest_array;
+		if (resolved.after) out[resolved.after] |= rest_array;
+		for (auto &element : resolved.run) collect(element);
+	}
+	else if (match.is<partial>())
+	{
+		auto &resolved = match.as<partial>();
+		if (resolved.remainder) out[resolved.remainder] |= rest_object;
+		collect(resolved.keys);
+	}
+}
+
+// Finds a rest generate splices into a kind of container it's never captured from, or returns null.  Rests
+// captured from both kinds are checked when spliced.
+rest const *mismatched_splice(luxem::value const &generate, std::unordered_map<symbol, int> const &rests)
+{
+	auto mismatched = [&](luxem::value const &element, rest_kind kind) -> rest const *
+	{
+		if (!element.is<rest>()) return mismatched_splice(element, rests);
+		auto &resolved = element.as<rest>();
+		auto found = rests.find(resolved.id);
+		if ((found != rests.end()) && !(found->second & kind)) return &resolved;
+		return nullptr;
+	};
+	if (generate.is<build_type>())
+	{
+		auto &value = generate.as<build_type>().value;
+		return value ? mismatched_splice(*value, rests) : nullptr;
+	}
+	if (generate.is<luxem::object>())
+	{
+		for (auto &pair : generate.as<luxem::object>().get_data()) 
+			if (auto found = mismatched(*pair.second, rest_object)) return found;
+	}
+	else if (generate.is<luxem::array>())
+	{
+		for (auto &element : generate.as<luxem::array>().get_data()) 
+			if (auto found = mismatched(*element, rest_array)) return found;
+	}
+	return nullptr;
+}
+
+// Checks that no node generated by generate, other than captured subtrees, can be matched by match
+bool generated_disjoint(luxem::value const &match, luxem::value const &generate)
+{
+	if (generate.is<match_definition_standin>() || generate.is<rest>()) return true;
+	if (!patterns_disjoint(match, generate)) return false;
+	if (generate.is<luxem::object>())
+	{
+		for (auto &pair : generate.as<luxem::object>().get_data()) 
+			if (!generated_disjoint(match, *pair.second)) return false;
+	}
+	else if (generate.is<luxem::array>())
+	{
+		for (auto &element : generate.as<luxem::array>().get_data()) 
+			if (!generated_disjoint(match, *element)) return false;
+	}
+	return true;
+}
+
+// Checks that earlier can't replace a node, or produce a replacement, that pattern would inspect below its
+// root.  Nodes only matched by *wild or a plain *match aren't inspected.
+bool positions_disjoint(
+	luxem::value const &pattern, 
+	luxemog::transform::transform_data::program const &earlier, 
+	bool root, 
+	size_t depth = 0)
+{
+	if (depth > disjoint_depth_limit) return false;
+	++depth;
+	if (pattern.is<wildcard>()) return true;
+	if (pattern.is<match_definition_standin>())
+	{
+		auto &definition = pattern.as<match_definition_standin>();
+		if (!definition || !definition->pattern) return false;
+		return positions_disjoint(*definition->pattern, earlier, root, depth);
+	}
+	if (!root)
+	{
+		if (!patterns_disjoint(pattern, *earlier.match)) return false;
+		if (earlier.generate && !patterns_disjoint(pattern, *earlier.generate)) return false;
+	}
+
+	auto children = [&](std::vector<std::shared_ptr<luxem::value>> const &elements)
+	{
+		for (auto &element : elements) if (!positions_disjoint(*element, earlier, false, depth)) return false;
+		return true;
+	};
+	if (pattern.is<alternate>())
+	{
+		for (auto &branch : pattern.as<alternate>().patterns) 
+			if (!positions_disjoint(*branch, earlier, root, depth)) return false;
+		return true;
+	}
+	if (pattern.is<type_regex>())
+	{
+		auto &value = pattern.as<type_regex>().value;
+		return !value || positions_disjoint(*value, earlier, root, depth);
+	}
+	if (pattern.is<sequence>()) return children(pattern.as<sequence>().run);
+	if (pattern.is<partial>())
+	{
+		for (auto &pair : pattern.as<partial>().keys->as<luxem::object>().get_data())
+			if (!positions_disjoint(*pair.second, earlier, false, depth)) return false;
+		return true;
+	}
+	if (pattern.is<luxem::object>())
+	{
+		for (auto &pair : pattern.as<luxem::object>().get_data())
+			if (!positions_disjoint(*pair.second, earlier, false, depth)) return false;
+		return true;
+	}
+	if (pattern.is<luxem::array>()) return children(pattern.as<luxem::array>().get_data());
+	return true;
+}
+
+bool generates_error(luxem::value const &pattern)
+{
+	if (pattern.is<error>()) return true;
+	if (pattern.is<build_type>()) 
+	{
+		auto &value = pattern.as<build_type>().value;
+		return value && generates_error(*value);
+	}
+	if (pattern.is<luxem::object>())
+		for (auto &pair : pattern.as<luxem::object>().get_data()) if (generates_error(*pair.second)) return true;
+	if (pattern.is<luxem::array>())
+		for (auto &element : pattern.as<luxem::array>().get_data()) if (generates_error(*element)) return true;
+	return false;
+}
+
+// Fused subtransforms try each node in turn, in one pre-order traversal, instead of each traversing the whole
+// tree in turn.  The results are the same when the subtransforms reenter, don't depend on their position
+// (no scope or subtransforms), and each later one neither matches what an earlier one generates nor inspects
+// anything below its match's root that an earlier one could change.  Then a later subtransform matching a
+// node before an earlier one has finished below it sees the same thing, and subtrees it captures and moves
+// are still visited by the earlier one in their new place.
+bool fusable(luxemog::transform::transform_data const &data, bool reverse)
+{
+	auto &program = data.programs[reverse];
+	return program && program->error.empty() && !data.scope && program->stages.empty() &&
+		(data.traversal == luxemog::traverse_reenter) &&
+		// An *error must be reached exactly as often as without fusing
+		!(program->generate && generates_error(*program->generate));
+}
+
+bool fusable(
+	luxemog::transform::transform_data::program const &earlier, 
+	luxemog::transform::transform_data::program const &later)
+{
+	if (later.generate && !generated_disjoint(*earlier.match, *later.generate)) return false;
+	return positions_disjoint(*later.match, earlier, true);
+}
+
+// Fills in everything derived from a program's patterns and its subtransforms' programs
+void finish_program(
+	luxemog::transform::transform_data::program &out, 
+	luxemog::transform::transform_data const &data, 
+	bool reverse)
+{
+	char const *match_name = reverse ? "'to'" : "'from'";
+	char const *generate_name = reverse ? "'from'" : "'to'";
+	char const *suffix = reverse ? " when reversing." : ".";
+
+	if (!out.match)
+	{
+		std::stringstream message;
+		message << "Transform missing " << match_name << " pattern" << suffix;
+		out.error = message.str();
+		return;
+	}
+	out.required = pattern_features(*out.match);
+	out.may_match_array = pattern_may_match_array(*out.match);
+
+	for (auto generating : {false, true})
+	{
+		auto &pattern = generating ? out.generate : out.match;
+		if (!pattern) continue;
+		std::unordered_set<luxem::value const *> seen;
+		auto found = misplaced_special(*pattern, generating, seen);
+		if (!found) continue;
+		std::stringstream message;
+		if (found->is<rest>())
+			message << "*rest can only be used at the start or end of *seq or as *partial's rest in " << 
+				match_name << " patterns" << suffix;
+		else message << found->get_name() << " cannot be used in " << 
+			(generating ? generate_name : match_name) << " patterns" << suffix;
+		out.error = message.str();
+		return;
+	}
+
+	if (out.generate)
+	{
+		std::unordered_map<symbol, int> rests;
+		std::unordered_set<luxem::value const *> seen;
+		captured_rests(*out.match, rests, seen);
+		if (auto found = mismatched_splice(*out.generate, rests))
+		{
+			bool const object = rests.at(found->id) & rest_object;
+			std::stringstream message;
+			message << "Rest " << *found->id << " is captured from " << 
+				(object ? "an object by *partial" : "an array by *seq") << 
+				" and can't be spliced into " << (object ? "an array" : "an object") << 
+				" in " << generate_name << " patterns" << suffix;
+			out.error = message.str();
+			return;
+		}
+	}
+
+	for (auto &subtransform : data.subtransforms)
+	{
+		auto &program = subtransform->programs[reverse];
+		if (program && !program->error.empty())
+		{
+			out.error = program->error;
+			return;
+		}
+	}
+
+	for (auto &subtransform : data.subtransforms)
+	{
+		auto &program = subtransform->programs[reverse];
+		if (program && program->dead) continue;
+		auto &stages = out.stages;
+		bool fuse = !stages.empty() && fusable(*subtransform, reverse) && fusable(*stages.back().front(), reverse);
+		if (fuse)
+			for (auto earlier : stages.back())
+				if (!fusable(*earlier->programs[reverse], *subtransform->programs[reverse])) fuse = false;
+		if (fuse) stages.back().push_back(subtransform.get());
+		else stages.push_back({subtransform.get()});
+	}
+}
+
+std::shared_ptr<luxemog::transform::transform_data::program const> compile_program(
+	luxemog::transform::transform_data const &data, 
+	bool reverse)
+{
+	auto out = std::make_shared<luxemog::transform::transform_data::program>();
+	out->match = reverse ? data.to : data.from;
+	out->generate = reverse ? data.from : data.to;
+	finish_program(*out, data, reverse);
+	return out;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// emitting
+// The last transform of a list can be applied while writing the target, generating its output straight into
+// the writer rather than building replacements.  Captured subtrees are written from the target, and only
+// nodes built by specials like *type are built.  The walk follows a pre-order scan, so it's only used when
+// scanning the pattern's literal nodes couldn't match.
+
+// True if writing while applying data gives the same output as applying it then writing
+bool emittable(luxemog::transform::transform_data const &data, bool reverse)
+{
+	auto &program = data.programs[reverse];
+	if (!program || !program->error.empty() || data.scope || !program->stages.empty()) return false;
+	if (data.traversal == luxemog::traverse_bottom_up) return false;
+	if ((data.traversal == luxemog::traverse_no_reenter) || !program->generate) return true;
+
+	// Reentering scans everything below a replacement's root
+	auto &generate = *program->generate;
+	if (generate.is<luxem::object>())
+	{
+		for (auto &pair : generate.as<luxem::object>().get_data())
+			if (!generated_disjoint(*program->match, *pair.second)) return false;
+	}
+	else if (generate.is<luxem::array>())
+	{
+		for (auto &element : generate.as<luxem::array>().get_data())
+			if (!generated_disjoint(*program->match, *element)) return false;
+	}
+	return true;
+}
+
+// Runs a scan of target by pattern to completion
+step_result scan_now(
+	scan_context &context, 
+	match_map &matches, 
+	std::shared_ptr<luxem::value> &target, 
+	std::shared_ptr<luxem::value> const &pattern)
+{
+	auto const depth = context.stack.size();
+	auto result = scan_node(context, matches, target, pattern);
+	while (context.stack.size() > depth)
+	{
+		result = context.stack.back()->step(context, result);
+		if ((result == step_fail) || (result == step_break)) context.stack.pop_back();
+	}
+	return result;
+}
+
+enum emit_action
+{
+	emit_scan, // Match tree then write it or its replacement
+	emit_write, // Write tree unchanged
+	emit_generate, // Write pattern as output of matches
+	emit_key,
+	emit_object_end,
+	emit_array_end
+};
+
+struct emit_item
+{
+	emit_action action;
+	std::shared_ptr<luxem::value> tree; // emit_scan, emit_write, and the owner of key for emit_key
+	std::shared_ptr<luxem::value> pattern; // emit_generate
+	std::shared_ptr<match_map> matches; // emit_generate
+	std::string const *key; // emit_key
+	bool replacement_root; // A replacement's root isn't scanned again, only its children
+};
+
+// Writes target with the transform on top of context's transform stack applied, without modifying target.
+// Only valid if the transform is emittable.
+void emit_transformed(scan_context &context, std::shared_ptr<luxem::value> const &target, luxem::writer &writer)
+{
+	auto &program = context.get_program();
+	bool const reenter = context.transform_stack.back()->traversal == luxemog::traverse_reenter;
+
+	std::vector<emit_item> stack;
+	auto push = [&stack](emit_action action, std::shared_ptr<luxem::value> const &tree, bool replacement_root)
+		{ stack.push_back(emit_item{action, tree, nullptr, nullptr, nullptr, replacement_root}); };
+	auto push_key = [&stack](std::string const &key, std::shared_ptr<luxem::value> const &owner)
+		{ stack.push_back(emit_item{emit_key, owner, nullptr, nullptr, &key, false}); };
+	auto push_generate = [&stack](std::shared_ptr<luxem::value> const &pattern, std::shared_ptr<match_map> const &matches)
+		{ stack.push_back(emit_item{emit_generate, nullptr, pattern, matches, nullptr, false}); };
+	// Target and captured nodes are only scanned again when reentering
+	auto push_captured = [&](std::shared_ptr<luxem::value> const &tree, bool replacement_root)
+		{ push(reenter ? emit_scan : emit_write, tree, replacement_root); };
+
+	push(emit_scan, target, false);
+	while (!stack.empty())
+	{
+		auto item = std::move(stack.back());
+		stack.pop_back();
+		switch (item.action)
+		{
+			case emit_key: writer.key(*item.key); break;
+			case emit_object_end: writer.object_end(); break;
+			case emit_array_end: writer.array_end(); break;
+			case emit_write: writer.value(*item.tree); break;
+			case emit_scan:
+			{
+				if (!may_contain_match(context, *item.tree))
+				{
+					writer.value(*item.tree);
+					break;
+				}
+				if (!item.replacement_root)
+				{
+					if (context.verbose) std::cerr << "Scanning " << item.tree->get_name() << std::endl;
+					auto matches = std::make_shared<match_map>();
+					if (scan_now(context, *matches, item.tree, program.match) != step_fail)
+					{
+						if (context.verbose) std::cerr << "Matched " << item.tree->get_name() << std::endl;
+						if (program.generate)
+						{
+							++context.replacements;
+							stack.push_back(emit_item{emit_generate, nullptr, program.generate, matches, nullptr, true});
+							break;
+						}
+						if (!reenter)
+						{
+							writer.value(*item.tree);
+							break;
+						}
+					}
+					else if (context.verbose) std::cerr << "Failed to match " << item.tree->get_name() << std::endl;
+				}
+
+				auto &tree = *item.tree;
+				if (tree.is<luxem::object>())
+				{
+					if (tree.has_type()) writer.type(tree.get_type());
+					writer.object_begin();
+					push(emit_object_end, nullptr, false);
+					auto &data = tree.as<luxem::object>().get_data();
+					for (auto pair = data.rbegin(); pair != data.rend(); ++pair)
+					{
+						push(emit_scan, pair->second, false);
+						push_key(pair->first, item.tree);
+					}
+				}
+				else if (tree.is<luxem::array>())
+				{
+					if (tree.has_type()) writer.type(tree.get_type());
+					writer.array_begin();
+					push(emit_array_end, nullptr, false);
+					auto &data = tree.as<luxem::array>().get_data();
+					for (auto element = data.rbegin(); element != data.rend(); ++element) 
+						push(emit_scan, *element, false);
+				}
+				else writer.value(tree);
+			} break;
+			case emit_generate:
+			{
+				auto &pattern = *item.pattern;
+				auto &matches = item.matches;
+				if (pattern.is<luxem::primitive>()) writer.value(pattern);
+				else if (pattern.is<luxem::object>())
+				{
+					if (pattern.has_type()) writer.type(pattern.get_type());
+					writer.object_begin();
+					push(emit_object_end, nullptr, false);
+
+					// Spliced keys don't replace earlier ones, as when building the object.  Each key maps to its
+					// child and, if spliced, the saved object that owns both.
+					typedef std::shared_ptr<luxem::value> const *tree_pointer;
+					std::map<
+						std::reference_wrapper<std::string const>, 
+						std::pair<tree_pointer, tree_pointer>, 
+						std::less<std::string>> children;
+					for (auto &pair : pattern.as<luxem::object>().get_data())
+					{
+						if (!pair.second->is<rest>()) 
+						{
+							children.emplace(pair.first, std::make_pair(&pair.second, nullptr));
+							continue;
+						}
+						auto &saved = pair.second->as<rest>().find(*matches);
+						for (auto &splice : pair.second->as<rest>().splice<luxem::object>(*matches)) 
+							children.emplace(splice.first, std::make_pair(&splice.second, &saved));
+					}
+					for (auto child = children.rbegin(); child != children.rend(); ++child)
+					{
+						auto owner = child->second.second;
+						if (owner) push_captured(*child->second.first, false);
+						else push_generate(*child->second.first, matches);
+						push_key(child->first, owner ? *owner : item.pattern);
+					}
+				}
+				else if (pattern.is<luxem::array>())
+				{
+					if (pattern.has_type()) writer.type(pattern.get_type());
+					writer.array_begin();
+					push(emit_array_end, nullptr, false);
+					auto &data = pattern.as<luxem::array>().get_data();
+					for (auto element = data.rbegin(); element != data.rend(); ++element)
+					{
+						if (!(*element)->is<rest>()) 
+						{
+							push_generate(*element, matches);
+							continue;
+						}
+						auto &saved = (*element)->as<rest>().splice<luxem::array>(*matches);
+						for (auto splice = saved.rbegin(); splice != saved.rend(); ++splice) 
+							push_captured(*splice, false);
+					}
+				}
+				else if (pattern.is<match_definition_standin>())
+					push_captured(pattern.as<match_definition_standin>()->find(*matches), item.replacement_root);
+				else if (pattern.is<rest>()) 
+					push_captured(pattern.as<rest>().find(*matches), item.replacement_root);
+				else
+				{
+					// Other specials build new nodes, scanned like generated nodes when reentering
+					std::shared_ptr<luxem::value> out;
+					transform_root(*matches, out, item.pattern, context.verbose);
+					push_captured(out, item.replacement_root);
+				}
+			} break;
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// optimizer
+// Simplifies each direction's program once loading finishes.  Changed patterns are copied rather than
+// modified, since the other direction and other transforms may share them.
+
+// Conservatively checks that a and b match the same trees
+bool patterns_equal(luxem::value const &a, luxem::value const &b, size_t depth = 0)
+{
+	if (&a == &b) return true;
+	if (depth > disjoint_depth_limit) return false;
+	++depth;
+	if (a.get_name() != b.get_name()) return false;
+	if (a.is<wildcard>()) return true;
+	if (a.is<match_definition_standin>())
+	{
+		auto &a_definition = a.as<match_definition_standin>();
+		auto &b_definition = b.as<match_definition_standin>();
+		if (!a_definition || !b_definition || !a_definition->pattern || !b_definition->pattern) return false;
+		return (a_definition->id == b_definition->id) && 
+			patterns_equal(*a_definition->pattern, *b_definition->pattern, depth);
+	}
+	if (a.is_derived<special>()) return false;
+
+	if (a.has_type() != b.has_type()) return false;
+	if (a.has_type() && (a.get_type() != b.get_type())) return false;
+	if (a.is<luxem::primitive>()) 
+		return a.as<luxem::primitive>().get_primitive() == b.as<luxem::primitive>().get_primitive();
+	if (a.is<luxem::object>())
+	{
+		auto &a_data = a.as<luxem::object>().get_data();
+		auto &b_data = b.as<luxem::object>().get_data();
+		if (a_data.size() != b_data.size()) return false;
+		for (auto &pair : a_data)
+		{
+			auto found = b_data.find(pair.first);
+			if (found == b_data.end()) return false;
+			if (!patterns_equal(*pair.second, *found->second, depth)) return false;
+		}
+		return true;
+	}
+	if (a.is<luxem::array>())
+	{
+		auto &a_data = a.as<luxem::array>().get_data();
+		auto &b_data = b.as<luxem::array>().get_data();
+		if (a_data.size() != b_data.size()) return false;
+		for (size_t index = 0; index < a_data.size(); ++index)
+			if (!patterns_equal(*a_data[index], *b_data[index], depth)) return false;
+		return true;
+	}
+	return false;
+}
+
+// Checks that pattern can't match any tree, counting specials that only work in 'to' patterns
+bool pattern_never_matches(luxem::value const &pattern, size_t depth = 0)
+{
+	if (depth > disjoint_depth_limit) return false;
+	++depth;
+	auto any = [depth](std::vector<std::shared_ptr<luxem::value>> const &elements)
+	{
+		for (auto &element : elements) if (pattern_never_matches(*element, depth)) return true;
+		return false;
+	};
+	if (pattern.is<build_type>() || pattern.is<build_string>() || pattern.is<error>() || pattern.is<rest>()) 
+		return true;
+	if (pattern.is<match_definition_standin>())
+	{
+		auto &definition = pattern.as<match_definition_standin>();
+		return definition && definition->pattern && pattern_never_matches(*definition->pattern, depth);
+	}
+	if (pattern.is<alternate>())
+	{
+		for (auto &branch : pattern.as<alternate>().patterns) 
+			if (!pattern_never_matches(*branch, depth)) return false;
+		return true;
 	}
-	else if (from->is_derived<special>())
+	if (pattern.is<type_regex>())
 	{
-		return from->as_derived<special>().scan(context, matches, target);
+		auto &value = pattern.as<type_regex>().value;
+		return value && pattern_never_matches(*value, depth);
 	}
-	else
+	if (pattern.is<sequence>()) return any(pattern.as<sequence>().run);
+	if (pattern.is<partial>())
 	{
-		assert(false);
-		return step_fail;
+		for (auto &pair : pattern.as<partial>().keys->as<luxem::object>().get_data())
+			if (pattern_never_matches(*pair.second, depth)) return true;
+		return false;
+	}
+	if (pattern.is<luxem::object>())
+	{
+		for (auto &pair : pattern.as<luxem::object>().get_data())
+			if (pattern_never_matches(*pair.second, depth)) return true;
+		return false;
 	}
+	if (pattern.is<luxem::array>()) return any(pattern.as<luxem::array>().get_data());
+	return false;
 }
 
-///////////////////////////////////////////////////////////////////////////////
-// transforming
+// Collects the ids of the saved trees generate uses
+void generated_ids(luxem::value const &generate, std::unordered_set<symbol> &out)
+{
+	if (generate.is<match_definition_standin>())
+	{
+		auto &definition = generate.as<match_definition_standin>();
+		if (definition) out.insert(definition->id);
+	}
+	else if (generate.is<rest>()) out.insert(generate.as<rest>().id);
+	else if (generate.is<build_type>())
+	{
+		auto &value = generate.as<build_type>().value;
+		if (value) generated_ids(*value, out);
+	}
+	else if (generate.is<luxem::object>())
+		for (auto &pair : generate.as<luxem::object>().get_data()) generated_ids(*pair.second, out);
+	else if (generate.is<luxem::array>())
+		for (auto &element : generate.as<luxem::array>().get_data()) generated_ids(*element, out);
+}
 
-struct object_transform_stackable : transform_stackable
+// Copies an object, array or primitive node, sharing its children
+std::shared_ptr<luxem::value> copy_node(luxem::value const &node)
 {
-	std::shared_ptr<luxem::object> out;
-	luxem::object const &to;
+	std::shared_ptr<luxem::value> out;
+	if (node.is<luxem::object>()) 
+		out = std::make_shared<luxem::object>(luxem::object::object_data(node.as<luxem::object>().get_data()));
+	else if (node.is<luxem::array>()) 
+		out = std::make_shared<luxem::array>(luxem::array::array_data(node.as<luxem::array>().get_data()));
+	else out = std::make_shared<luxem::primitive>(node.as<luxem::primitive>().get_primitive());
+	if (node.has_type()) out->set_type(node.get_type());
+	return out;
+}
 
-	luxem::object::object_data::const_iterator to_iterator;
+// Gets the type a *type_regex requires exactly, if its only regex is an anchored literal without ids
+bool literal_type(type_regex const &pattern, std::string &out)
+{
+	if (pattern.allow_missing || !pattern.value || pattern.value->is_derived<special>()) return false;
+	auto &definitions = pattern.type_definition.patterns;
+	if (definitions.size() != 1) return false;
+	auto &definition = *definitions.front();
+	if (!definition.ids.empty() || definition.has_replace) return false;
+	auto &text = definition.regex->pattern;
+	if ((text.size() < 2) || (text.front() != '^') || (text.back() != '$')) return false;
+	out = text.substr(1, text.size() - 2);
+	return out.find_first_of("\\^$.|?*+()[]{}") == std::string::npos;
+}
 
-	object_transform_stackable(std::shared_ptr<luxem::object> out, luxem::object &to) : 
-		out(out), 
-		to(to), 
-		to_iterator(to.get_data().begin()) 
-		{}
+struct pattern_rewriter
+{
+	std::unordered_set<symbol> const &used; // Ids the generating pattern references
+	std::vector<std::string> &changes;
 
-	bool step(transform_context &context, match_map &matches) override
+	// Returns pattern itself if nothing changed
+	std::shared_ptr<luxem::value> rewrite(std::shared_ptr<luxem::value> const &pattern, size_t depth = 0)
 	{
-		if (to_iterator == to.get_data().end()) return false;
-		out->get_data().emplace(to_iterator->first, transform_node(context, matches, to_iterator->second));
-		++to_iterator;
-		return true;
+		if (!pattern || (depth > disjoint_depth_limit)) return pattern;
+		++depth;
+		if (pattern->is<alternate>())
+		{
+			auto &branches = pattern->as<alternate>().patterns;
+			if (branches.size() != 1) return pattern;
+			changes.push_back("flattened a single-branch *alt");
+			return rewrite(branches.front(), depth);
+		}
+		if (pattern->is<type_regex>())
+		{
+			std::string type;
+			auto &node = pattern->as<type_regex>();
+			if (!literal_type(node, type)) return pattern;
+			auto out = copy_node(*rewrite(node.value, depth));
+			out->set_type(type);
+			changes.push_back("folded a *type_regex into an exact check for type " + type);
+			return out;
+		}
+		if (pattern->is<match_definition_standin>())
+		{
+			auto &definition = pattern->as<match_definition_standin>();
+			if (!definition || !definition->pattern) return pattern;
+			if (!used.count(definition->id))
+			{
+				changes.push_back("removed unused *match " + *definition->id);
+				return rewrite(definition->pattern, depth);
+			}
+			auto rewritten = rewrite(definition->pattern, depth);
+			if (rewritten == definition->pattern) return pattern;
+			auto copy = std::make_shared<match_definition>();
+			copy->id = definition->id;
+			copy->pattern = std::move(rewritten);
+			return std::make_shared<match_definition_standin>(copy);
+		}
+		if (pattern->is<luxem::object>())
+		{
+			std::shared_ptr<luxem::value> out;
+			for (auto &pair : pattern->as<luxem::object>().get_data())
+			{
+				auto rewritten = rewrite(pair.second, depth);
+				if (rewritten == pair.second) continue;
+				if (!out) out = copy_node(*pattern);
+				out->as<luxem::object>().get_data()[pair.first] = std::move(rewritten);
+			}
+			return out ? out : pattern;
+		}
+		if (pattern->is<luxem::array>())
+		{
+			std::shared_ptr<luxem::value> out;
+			auto &elements = pattern->as<luxem::array>().get_data();
+			for (size_t index = 0; index < elements.size(); ++index)
+			{
+				auto rewritten = rewrite(elements[index], depth);
+				if (rewritten == elements[index]) continue;
+				if (!out) out = copy_node(*pattern);
+				out->as<luxem::array>().get_data()[index] = std::move(rewritten);
+			}
+			return out ? out : pattern;
+		}
+		return pattern;
 	}
 };
 
-struct array_transform_stackable : transform_stackable
+void report_optimization(bool verbose, std::string const &name, bool reverse, std::string const &change)
 {
-	std::shared_ptr<luxem::array> out;
-	luxem::array const &to;
-
-	luxem::array::array_data::const_iterator to_iterator;
+	if (!verbose) return;
+	std::cerr << "Optimized " << name << (reverse ? " (reversed)" : "") << ": " << change << std::endl;
+}
 
-	array_transform_stackable(std::shared_ptr<luxem::array> out, luxem::array &to) : 
-		out(out), 
-		to(to), 
-		to_iterator(to.get_data().begin()) 
-		{}
+// Checks that after earlier, nothing is left that later's identical pattern could match.  Reentering
+// earlier replaces every match it visits, its output can't match, and it can't make an ancestor match,
+// as with fusing.
+bool shadows(
+	luxemog::transform::transform_data const &earlier_data, 
+	luxemog::transform::transform_data::program const &later, 
+	bool reverse)
+{
+	auto &earlier = *earlier_data.programs[reverse];
+	if (!earlier.error.empty() || !later.error.empty() || !later.match) return false;
+	if (earlier_data.scope || (earlier_data.traversal != luxemog::traverse_reenter)) return false;
+	if (!earlier.generate || !earlier.stages.empty()) return false;
+	if (!patterns_equal(*earlier.match, *later.match)) return false;
+	return patterns_disjoint(*later.match, *earlier.generate) && 
+		generated_disjoint(*later.match, *earlier.generate) &&
+		positions_disjoint(*later.match, earlier, true);
+}
 
-	bool step(transform_context &context, match_map &matches) override
+// Drops transforms shadowed by the live transform before them
+void drop_shadowed(
+	std::vector<luxemog::transform::transform_data *> const &sequence, 
+	std::vector<std::string> const &names,
+	bool reverse,
+	bool verbose)
+{
+	size_t previous = sequence.size();
+	for (size_t index = 0; index < sequence.size(); ++index)
 	{
-		if (to_iterator == to.get_data().end()) return false;
-		out->get_data().emplace_back(transform_node(context, matches, *to_iterator));
-		++to_iterator;
-		return true;
+		auto &program = sequence[index]->programs[reverse];
+		if (program->dead) continue;
+		if ((previous == sequence.size()) || !shadows(*sequence[previous], *program, reverse))
+		{
+			previous = index;
+			continue;
+		}
+		auto copy = std::make_shared<luxemog::transform::transform_data::program>(*program);
+		copy->dead = true;
+		program = std::move(copy);
+		report_optimization(verbose, names[index], reverse, 
+			"dropped, since " + names[previous] + " has the same pattern and replaces every match");
 	}
-};
+}
 
-std::shared_ptr<luxem::value> transform_node(
-	transform_context &context, 
-	match_map const &matches, 
-	std::shared_ptr<luxem::value> const &to)
+void optimize_transform(
+	luxemog::transform::transform_data &data, 
+	std::string const &name, 
+	bool reverse, 
+	bool verbose)
 {
-	if (to->is<luxem::primitive>())
+	if (!data.programs[reverse]) throw std::runtime_error("Transform hasn't finished loading.");
+	std::vector<luxemog::transform::transform_data *> sequence;
+	std::vector<std::string> names;
+	for (auto &subtransform : data.subtransforms)
 	{
-		auto out = std::make_shared<luxem::primitive>(to->as<luxem::primitive>().get_primitive());
-		if (to->has_type()) out->set_type(to->get_type());
-		return out;
+		std::stringstream subname;
+		subname << name << ", subtransform " << sequence.size();
+		optimize_transform(*subtransform, subname.str(), reverse, verbose);
+		sequence.push_back(subtransform.get());
+		names.push_back(subname.str());
 	}
-	else if (to->is<luxem::object>())
+	drop_shadowed(sequence, names, reverse, verbose);
+
+	auto &old = *data.programs[reverse];
+	if (old.dead) return;
+	if (!old.error.empty())
 	{
-		auto out = std::make_shared<luxem::object>();
-		if (to->has_type()) out->set_type(to->get_type());
-		context.stack.emplace_back(std::make_unique<object_transform_stackable>(out, to->as<luxem::object>()));
-		return out;
+		// Kept for validate to report, unless it can't run anyway
+		if (!old.match || !pattern_never_matches(*old.match)) return;
+		auto copy = std::make_shared<luxemog::transform::transform_data::program>(old);
+		copy->dead = true;
+		copy->error.clear();
+		data.programs[reverse] = std::move(copy);
+		report_optimization(verbose, name, reverse, "dropped, since its pattern can never match");
+		return;
 	}
-	else if (to->is<luxem::array>())
+	auto out = std::make_shared<luxemog::transform::transform_data::program>();
+	std::vector<std::string> changes;
+	out->generate = old.generate;
+	if (old.match)
 	{
-		auto out = std::make_shared<luxem::array>();
-		if (to->has_type()) out->set_type(to->get_type());
-		context.stack.emplace_back(std::make_unique<array_transform_stackable>(out, to->as<luxem::array>()));
-		return out;
+		std::unordered_set<symbol> used;
+		if (old.generate) generated_ids(*old.generate, used);
+		pattern_rewriter rewriter{used, changes};
+		out->match = rewriter.rewrite(old.match);
 	}
-	else if (to->is_derived<special>())
+	finish_program(*out, data, reverse);
+
+	if (out->match && pattern_never_matches(*out->match))
 	{
-		return to->as_derived<special>().generate(context, matches);
+		out->dead = true;
+		changes = {"dropped, since its pattern can never match"};
 	}
-	else
+	else if (!out->generate && out->stages.empty() && out->error.empty())
 	{
-		assert(false);
-		return {};
+		out->dead = true;
+		changes = {"dropped, since it has no output or live subtransforms"};
 	}
-}
-
-void transform_root(
-	match_map &matches, 
-	std::shared_ptr<luxem::value> &root,
-	std::shared_ptr<luxem::value> const &to,
-	bool verbose)
-{
-	transform_context context{verbose};
-	root = transform_node(context, matches, to);
-	while (!context.stack.empty()) 
-		if (!context.stack.back()->step(context, matches))
-			context.stack.pop_back();
+	if (out->dead) out->error.clear();
+	for (auto &change : changes) report_optimization(verbose, name, reverse, change);
+	data.programs[reverse] = std::move(out);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -900,6 +4008,7 @@ struct build_context
 {
 	bool root;
 	std::map<std::string, std::shared_ptr<match_definition>> match_definitions;
+	std::list<std::function<void(void)>> finishers; // Run once the whole transform is built
 		
 	struct pre_match_definition
 	{
@@ -917,7 +4026,7 @@ struct build_context
 		else
 		{
 			auto definition = std::make_shared<match_definition>();
-			definition->id = id;
+			definition->id = intern(id);
 			match_definitions.emplace(id, definition);
 			return definition;
 		}
@@ -926,6 +4035,9 @@ struct build_context
 	std::shared_ptr<luxem::value> match_from_object(std::shared_ptr<luxem::value> &data);
 };
 
+void build_finally(build_context &context, std::function<void(void)> &&callback)
+	{ context.finishers.push_back(std::move(callback)); }
+
 bool build_special(build_context &context, std::shared_ptr<luxem::value> &data)
 {
 	if (data->get_type() == "*match")
@@ -947,8 +4059,21 @@ bool build_special(build_context &context, std::shared_ptr<luxem::value> &data)
 	}
 	else if (data->get_type() == "*alt")
 	{
-		auto &array_data = data->as<luxem::reader::array_context>();
-		data = std::make_shared<alternate>(context, array_data);
+		if (data->is<luxem::reader::object_context>())
+			data = std::make_shared<alternate>(context, data->as<luxem::reader::object_context>());
+		else data = std::make_shared<alternate>(context, data->as<luxem::reader::array_context>());
+	}
+	else if (data->get_type() == "*seq")
+	{
+		data = std::make_shared<sequence>(context, data->as<luxem::reader::array_context>());
+	}
+	else if (data->get_type() == "*partial")
+	{
+		data = std::make_shared<partial>(context, data->as<luxem::reader::object_context>());
+	}
+	else if (data->get_type() == "*rest")
+	{
+		data = std::make_shared<rest>(intern(data->as<luxem::primitive>().get_primitive()));
 	}
 	else if (data->get_type() == "*regex")
 	{
@@ -1022,12 +4147,23 @@ std::shared_ptr<luxem::value> build_context::match_from_object(std::shared_ptr<l
 namespace luxemog
 {
 
-transform::transform(std::shared_ptr<luxem::value> &&data, bool verbose) : 
-	verbose(verbose), data(std::move(data))
+regex_pool_stats get_regex_pool_stats(void)
+{
+	auto &pool = regex_pool::instance();
+	regex_pool_stats out;
+	out.entries = pool.count();
+	out.compiled = pool.compiled;
+	out.compile_seconds = pool.compile_nanoseconds / 1e9;
+	return out;
+}
+
+transform::transform(std::shared_ptr<luxem::value> &&data, bool verbose, traversal_order default_traversal) : 
+	verbose(verbose), data(std::move(data), default_traversal)
 {
 }
 
-transform::transform_data::transform_data(std::shared_ptr<luxem::value> &&data)
+transform::transform_data::transform_data(std::shared_ptr<luxem::value> &&data, traversal_order default_traversal) :
+	traversal(default_traversal)
 {
 	auto &object = data->as<luxem::reader::object_context>();
 	
@@ -1060,52 +4196,435 @@ transform::transform_data::transform_data(std::shared_ptr<luxem::value> &&data)
 					throw std::runtime_error("Only specials may be defined in 'matches'.");
 			});
 		});
+
+		object.finally([this, context](void) 
+		{ 
+			for (auto &finisher : context->finishers) finisher(); 
+			programs[0] = compile_program(*this, false);
+			programs[1] = compile_program(*this, true);
+		});
 	}
 
 	object.element(
 		"subtransforms",
-		[this](std::shared_ptr<luxem::value> &&data) 
+		[this, default_traversal](std::shared_ptr<luxem::value> &&data) 
 		{
-			data->as<luxem::reader::array_context>().element([this](std::shared_ptr<luxem::value> &&data)
-				{ subtransforms.emplace_back(std::make_unique<transform_data>(std::move(data))); });
+			data->as<luxem::reader::array_context>().element([this, default_traversal](std::shared_ptr<luxem::value> &&data)
+				{ subtransforms.emplace_back(std::make_unique<transform_data>(std::move(data), default_traversal)); });
 		}
 	);
+
+	object.element("scope", [this](std::shared_ptr<luxem::value> &&data)
+		{ scope = std::make_shared<scope_pattern>(std::move(data)); });
+
+	object.element("traversal", [this](std::shared_ptr<luxem::value> &&data)
+	{
+		auto &name = data->as<luxem::primitive>().get_primitive();
+		if (name == "reenter") traversal = traverse_reenter;
+		else if (name == "no_reenter") traversal = traverse_no_reenter;
+		else if (name == "bottom_up") traversal = traverse_bottom_up;
+		else
+		{
+			std::stringstream message;
+			message << "Unknown traversal '" << name << "'.";
+			throw std::runtime_error(message.str());
+		}
+	});
 }
 
-void transform::apply(std::shared_ptr<luxem::value> &target, bool reverse)
+void transform::validate(bool reverse) const
 {
-	scan_context context{verbose, reverse};
-	context.transform_stack.push_back(&data);
-	context.stack.push_back(std::make_unique<scan_root_stackable>(target));
+	auto &program = data.programs[reverse];
+	if (!program) throw std::runtime_error("Transform hasn't finished loading.");
+	if (!program->error.empty()) throw std::runtime_error(program->error);
+}
+
+bool transform::streamable(bool reverse) const
+{
+	if (!(scope_start(data) & scope_inside)) return true;
+	auto &program = data.programs[reverse];
+	return program && (program->dead || !program->may_match_array);
+}
+
+void transform::apply(std::shared_ptr<luxem::value> &target, bool reverse) const
+{
+	validate(reverse);
+	apply(target, reverse, scope_start(data), nullptr);
+}
+
+void transform::apply_element(std::shared_ptr<luxem::value> &element, size_t index, bool reverse) const
+{
+	validate(reverse);
+	auto scope = scope_advance(data, scope_start(data), nullptr, index, *element);
+	if (!scope) return;
+	apply(element, reverse, scope, nullptr);
+}
 
-	size_t count = 0; // DEBUG
+// Where an apply has got to: the transform being applied and the state of its scan, so the work can be
+// done a bounded number of steps at a time
+struct apply_state
+{
+	transform_list const &list;
+	std::shared_ptr<luxem::value> &target;
+	bool const reverse;
+	bool const element;
+	size_t const index;
+	std::unique_ptr<subtree_summaries> summaries;
+	std::unique_ptr<subtree_hashes> hashes; // Made when the first memoized transform starts
+	std::shared_ptr<transform_index const> live_index;
+	std::vector<bool> live;
+	std::list<std::unique_ptr<transform>>::const_iterator next;
+	std::list<std::unique_ptr<transform>>::const_iterator end; // Transforms from here on aren't applied
+	size_t position = 0;
+	transform const *current = nullptr;
+	std::unique_ptr<scan_context> context;
 	step_result last_result = step_push;
-	while (!context.stack.empty())
+
+	apply_state(
+		transform_list const &list, 
+		std::shared_ptr<luxem::value> &target, 
+		bool reverse, 
+		bool element, 
+		size_t index) : 
+		list(list), target(target), reverse(reverse), element(element), index(index), 
+		next(list.transforms.begin()), 
+		end(list.transforms.end())
 	{
-		++count; // DEBUG
-		if (count > 1000) assert(false); // DEBUG
-		last_result = context.stack.back()->step(context, last_result);
-		switch (last_result)
+		list.validate(reverse);
+
+		if (list.summarize)
 		{
-			case step_fail: context.stack.pop_back(); break;
-			case step_break: context.stack.pop_back(); break;
-			default: break;
+			summaries = std::make_unique<subtree_summaries>();
+			summarize_subtrees(target, *summaries);
+		}
+
+		// Transforms that can't match anywhere are skipped, rechecking whenever the target changes
+		live_index = list.get_index(reverse);
+		if (live_index) live_index->mark_live(*target, live);
+	}
+
+	// Returns true once every transform has been applied, after at most quota steps
+	bool resume(size_t quota)
+	{
+		while (true)
+		{
+			if (context)
+			{
+				if (!run(*context, last_result, quota)) return false;
+				if (finish(*context, *current) && live_index) live_index->mark_live(*target, live);
+				context.reset();
+			}
+			if (!start_next()) return true;
+		}
+	}
+
+	bool start_next(void)
+	{
+		while (next != end)
+		{
+			auto &transform = **next++;
+			if (live_index && !live[position++]) continue;
+			if (transform.data.programs[reverse]->dead) continue;
+			auto scope = scope_start(transform.data);
+			if (element) 
+			{
+				scope = scope_advance(transform.data, scope, nullptr, index, *target);
+				if (!scope) continue;
+			}
+			context.reset(new scan_context{transform.verbose, reverse});
+			last_result = step_push;
+			if (start(*context, transform, target, scope, summaries.get(), hashes))
+			{
+				current = &transform;
+				return true;
+			}
+			context.reset();
+		}
+		return false;
+	}
+
+	// Returns false if nothing in target can match
+	static bool start(
+		scan_context &context, 
+		transform const &transform, 
+		std::shared_ptr<luxem::value> &target, 
+		uint64_t scope, 
+		subtree_summaries *summaries,
+		std::unique_ptr<subtree_hashes> &hashes)
+	{
+		context.transform_stack.push_back(&transform.data);
+		context.summaries = summaries;
+		if (!may_contain_match(context, *target)) return false;
+		context.pool = transform.pool.get();
+		if (context.pool) context.pool_scan = context.pool->begin_scan();
+		context.profile = transform.profile.get();
+		if (transform.memo)
+		{
+			// Later transforms reuse the hashes, less those of subtrees changed since
+			if (!hashes)
+			{
+				hashes = std::make_unique<subtree_hashes>();
+				hash_subtrees(target, *hashes);
+			}
+			context.memo = transform.memo.get();
+			context.hashes = hashes.get();
+		}
+		context.stack.push_back(make_scan_root(context, target, transform.data.traversal, scope, true));
+		return true;
+	}
+
+	// Steps the scan until it's done, returning false if quota runs out first
+	static bool run(scan_context &context, step_result &last_result, size_t &quota)
+	{
+		while (!context.stack.empty())
+		{
+			if (quota == 0) return false;
+			--quota;
+			last_result = context.stack.back()->step(context, last_result);
+			switch (last_result)
+			{
+				case step_fail: context.stack.pop_back(); break;
+				case step_break: context.stack.pop_back(); break;
+				default: break;
+			}
 		}
+		return true;
+	}
+
+	// Returns the number of replacements
+	static size_t finish(scan_context &context, transform const &transform)
+	{
+		if (transform.profile) transform.profile->merge(context.profile_samples);
+		return context.replacements;
+	}
+};
+
+size_t transform::apply(
+	std::shared_ptr<luxem::value> &target, 
+	bool reverse, 
+	uint64_t scope, 
+	subtree_summaries *summaries) const
+{
+	scan_context context{verbose, reverse};
+	std::unique_ptr<subtree_hashes> hashes;
+	if (!apply_state::start(context, *this, target, scope, summaries, hashes)) return 0;
+	step_result last_result = step_push;
+	size_t quota = std::numeric_limits<size_t>::max();
+	apply_state::run(context, last_result, quota);
+	return apply_state::finish(context, *this);
+}
+
+apply_job::apply_job(std::unique_ptr<apply_state> &&state) : state(std::move(state)) {}
+
+apply_job::apply_job(apply_job &&other) = default;
+
+apply_job::~apply_job(void) {}
+
+apply_status apply_job::resume(size_t step_quota)
+{
+	if (!state) return apply_done;
+	bool done;
+	try { done = state->resume(step_quota); }
+	catch (...)
+	{
+		state.reset();
+		throw;
 	}
+	if (!done) return apply_pending;
+	state.reset();
+	return apply_done;
 }
+
 	
-transform_list::transform_list(bool verbose) : verbose(verbose) {}
+transform_list::transform_list(bool verbose, traversal_order default_traversal) : 
+	verbose(verbose), default_traversal(default_traversal) {}
 
 void transform_list::deserialize(std::shared_ptr<luxem::value> &&root)
 {
 	root->as<luxem::reader::array_context>().element([this](std::shared_ptr<luxem::value> &&data)
-		{ transforms.emplace_back(std::make_unique<transform>(std::move(data), verbose)); });
+	{ 
+		transforms.emplace_back(std::make_unique<transform>(std::move(data), verbose, default_traversal)); 
+		transforms.back()->memo = memo;
+		transforms.back()->pool = pool;
+		transforms.back()->profile = profile;
+	});
+	std::atomic_store(&indexes[0], std::shared_ptr<transform_index const>());
+	std::atomic_store(&indexes[1], std::shared_ptr<transform_index const>());
+}
+
+void transform_list::set_memo_capacity(size_t capacity)
+{
+	if (capacity) memo = std::make_shared<transform_memo>(capacity);
+	else memo.reset();
+	for (auto &transform : transforms) transform->memo = memo;
+}
+
+void transform_list::set_share_output(bool share)
+{
+	if (share) pool = std::make_shared<output_pool>();
+	else pool.reset();
+	for (auto &transform : transforms) transform->pool = pool;
+}
+
+void transform_list::set_subtree_summaries(bool enable) { summarize = enable; }
+
+void transform_list::apply(std::shared_ptr<luxem::value> &target, bool reverse) const
+	{ apply(target, reverse, false, 0); }
+
+std::shared_ptr<transform_index const> transform_list::get_index(bool reverse) const
+{
+	if (transforms.size() < index_minimum_transforms) return nullptr;
+	auto &index = indexes[reverse ? 1 : 0];
+	auto out = std::atomic_load(&index);
+	if (out) return out;
+
+	// Built on first use, once every transform is fully loaded
+	std::lock_guard<std::mutex> lock(index_mutex);
+	out = std::atomic_load(&index);
+	if (out) return out;
+	auto built = std::make_shared<transform_index>(transforms.size());
+	size_t position = 0;
+	for (auto &transform : transforms) 
+	{
+		auto &program = transform->data.programs[reverse];
+		if (!program->dead) built->add(program->match.get(), position);
+		++position;
+	}
+	out = std::move(built);
+	std::atomic_store(&index, out);
+	return out;
+}
+
+void transform_list::apply(std::shared_ptr<luxem::value> &target, bool reverse, bool element, size_t index) const
+{
+	apply_state state(*this, target, reverse, element, index);
+	state.resume(std::numeric_limits<size_t>::max());
+}
+
+bool transform_list::emittable(bool reverse) const
+	{ return transforms.empty() || ::emittable(transforms.back()->data, reverse); }
+
+void transform_list::apply_and_write(std::shared_ptr<luxem::value> &target, luxem::writer &writer, bool reverse) const
+	{ apply_and_write(target, writer, reverse, false, 0); }
+
+void transform_list::apply_element_and_write(
+	std::shared_ptr<luxem::value> &element, 
+	size_t index, 
+	luxem::writer &writer, 
+	bool reverse) const
+	{ apply_and_write(element, writer, reverse, true, index); }
+
+void transform_list::apply_and_write(
+	std::shared_ptr<luxem::value> &target, 
+	luxem::writer &writer, 
+	bool reverse, 
+	bool element, 
+	size_t index) const
+{
+	apply_state state(*this, target, reverse, element, index);
+	if (transforms.empty() || !emittable(reverse))
+	{
+		state.resume(std::numeric_limits<size_t>::max());
+		writer.value(*target);
+		return;
+	}
+
+	state.end = std::prev(transforms.end());
+	state.resume(std::numeric_limits<size_t>::max());
+	auto &last = *transforms.back();
+	if ((state.live_index && !state.live[transforms.size() - 1]) || last.data.programs[reverse]->dead)
+	{
+		writer.value(*target);
+		return;
+	}
+
+	// Without a scope, the last transform applies to elements as to the whole target
+	scan_context context{last.verbose, reverse};
+	context.transform_stack.push_back(&last.data);
+	context.summaries = state.summaries.get();
+	context.profile = last.profile.get();
+	emit_transformed(context, target, writer);
+	apply_state::finish(context, last);
+}
+
+apply_job transform_list::begin_apply(std::shared_ptr<luxem::value> &target, bool reverse) const
+	{ return apply_job(std::make_unique<apply_state>(*this, target, reverse, false, 0)); }
+
+void transform_list::set_profiling(bool enable)
+{
+	if (enable) profile = std::make_shared<transform_profile>();
+	else profile.reset();
+	for (auto &transform : transforms) transform->profile = profile;
+}
+
+void transform_list::write_profile(std::ostream &out, bool attempts) const
+{
+	if (!profile) return;
+	profile_labels labels;
+	size_t index = 0;
+	for (auto &transform : transforms)
+	{
+		std::stringstream name;
+		name << "transform " << index++;
+		labels.label_transform(transform->data, name.str());
+	}
+
+	std::map<std::string, uint64_t> lines;
+	{
+		std::lock_guard<std::mutex> lock(profile->mutex);
+		for (auto &pair : profile->samples)
+		{
+			std::string stack;
+			for (auto node : pair.first) stack += (stack.empty() ? "" : ";") + labels.get(node);
+			lines[stack] += attempts ? pair.second.attempts : pair.second.nanoseconds;
+		}
+	}
+	for (auto &line : lines) out << line.first << " " << line.second << "\n";
+}
+
+void transform_list::optimize(void)
+{
+	for (auto reverse : {false, true})
+	{
+		std::vector<transform::transform_data *> sequence;
+		std::vector<std::string> names;
+		for (auto &transform : transforms)
+		{
+			std::stringstream name;
+			name << "transform " << sequence.size();
+			optimize_transform(transform->data, name.str(), reverse, verbose);
+			sequence.push_back(&transform->data);
+			names.push_back(name.str());
+		}
+		drop_shadowed(sequence, names, reverse, verbose);
+	}
+	std::atomic_store(&indexes[0], std::shared_ptr<transform_index const>());
+	std::atomic_store(&indexes[1], std::shared_ptr<transform_index const>());
 }
 
-void transform_list::apply(std::shared_ptr<luxem::value> &target, bool reverse)
+void transform_list::validate(bool reverse) const
 {
-	for (auto &transform : transforms) transform->apply(target, reverse);
+	size_t position = 0;
+	for (auto &transform : transforms)
+	{
+		try { transform->validate(reverse); }
+		catch (std::runtime_error &exception)
+		{
+			std::stringstream message;
+			message << "Transform " << position << ": " << exception.what();
+			throw std::runtime_error(message.str());
+		}
+		++position;
+	}
 }
 
+bool transform_list::streamable(bool reverse) const
+{
+	for (auto &transform : transforms) if (!transform->streamable(reverse)) return false;
+	return true;
 }
 
+void transform_list::apply_element(std::shared_ptr<luxem::value> &element, size_t index, bool reverse) const
+	{ apply(element, reverse, true, index); }
+
+}
@@ -3,37 +3,245 @@
 
 #include <luxem-cxx/luxem.h>
 
+#include <unordered_map>
+#include <iosfwd>
+#include <mutex>
+
 namespace luxemog
 {
 
+enum traversal_order
+{
+	traverse_reenter, // Pre-order, also scanning the children of generated replacements
+	traverse_no_reenter, // Pre-order, skipping subtrees once they've matched
+	traverse_bottom_up // Post-order, so children are transformed before their parents
+};
+
+struct regex_pool_stats
+{
+	size_t entries; // Distinct regexes held by loaded transforms
+	size_t compiled; // How many of those are compiled, since they're compiled on first use
+	double compile_seconds; // Total time spent compiling
+};
+
+// Regexes are shared by every transform in the process
+regex_pool_stats get_regex_pool_stats(void);
+
+struct transform_memo;
+struct output_pool;
+struct transform_profile;
+struct subtree_summaries;
+struct transform_index;
+struct apply_state;
+
 struct transform
 {
-	transform(std::shared_ptr<luxem::value> &&root, bool verbose = false);
-	void apply(std::shared_ptr<luxem::value> &target, bool reverse = false);
+	transform(std::shared_ptr<luxem::value> &&root, bool verbose = false, traversal_order default_traversal = traverse_reenter);
+
+	// Doesn't modify the transform; all scanning state is local to the call, so any number of threads may
+	// apply one transform at once
+	void apply(std::shared_ptr<luxem::value> &target, bool reverse = false) const;
+
+	// Throws if the transform can't be applied in this direction, for instance if the pattern generating
+	// output contains *regex.  apply checks this before changing anything.
+	void validate(bool reverse = false) const;
+
+	// True if the transform can't match an array at the root, so a root array's elements can be
+	// transformed one at a time with apply_element
+	bool streamable(bool reverse = false) const;
+
+	// Transforms element as if it were at index in a root array
+	void apply_element(std::shared_ptr<luxem::value> &element, size_t index, bool reverse = false) const;
 
 	struct transform_data // Internal only, basically private
 	{
-		transform_data(std::shared_ptr<luxem::value> &&root);
+		transform_data(std::shared_ptr<luxem::value> &&root, traversal_order default_traversal);
+		traversal_order traversal;
+		struct scope_pattern;
+		std::shared_ptr<scope_pattern> scope;
 		std::shared_ptr<luxem::value> from, to;
 		std::list<std::unique_ptr<transform_data>> subtransforms;
+		struct program;
+		std::shared_ptr<program const> programs[2]; // Forward and reverse, compiled once loaded
 	};
 
+	std::shared_ptr<transform_memo> memo; // Internal only, set by transform_list
+	std::shared_ptr<output_pool> pool; // Internal only, set by transform_list
+	std::shared_ptr<transform_profile> profile; // Internal only, set by transform_list
+
 	private:
+		friend struct transform_list;
+		friend struct apply_state;
+
+		// Returns the number of replacements
+		size_t apply(
+			std::shared_ptr<luxem::value> &target, 
+			bool reverse, 
+			uint64_t scope, 
+			subtree_summaries *summaries) const;
+
 		bool verbose;
 
 		transform_data data;
 };
 
+enum apply_status
+{
+	apply_pending, // Call resume again
+	apply_done // The target is fully transformed
+};
+
+// An apply in progress, from transform_list::begin_apply
+struct apply_job
+{
+	apply_job(apply_job &&other);
+	~apply_job(void);
+
+	// Does at most step_quota steps of scanning, where a step is a single pattern node tried at a single
+	// value.  Keeps returning apply_done once done.
+	apply_status resume(size_t step_quota);
+
+	private:
+		friend struct transform_list;
+		apply_job(std::unique_ptr<apply_state> &&state);
+		std::unique_ptr<apply_state> state;
+};
+
 struct transform_list
 {
-	transform_list(bool verbose = false);
+	transform_list(bool verbose = false, traversal_order default_traversal = traverse_reenter);
 	void deserialize(std::shared_ptr<luxem::value> &&root);
 
-	void apply(std::shared_ptr<luxem::value> &target, bool reverse = false);
+	// Remembers the results of transforming up to capacity repeated subtrees, 0 to disable
+	void set_memo_capacity(size_t capacity);
+
+	// Makes identical generated subtrees share one instance, across all targets: results may share nodes
+	// with each other, so don't modify them outside apply
+	void set_share_output(bool share);
+
+	// Summarizes the types, keys and primitives in each subtree of a target before transforming it, and
+	// skips subtrees missing something every match of a transform needs
+	void set_subtree_summaries(bool enable);
+
+	// Records scan time and attempts for each pattern node
+	void set_profiling(bool enable);
+
+	// Writes the profile as folded stacks, one line per pattern node path with its total self time in
+	// nanoseconds, or attempt count
+	void write_profile(std::ostream &out, bool attempts = false) const;
+
+	// Safe to call from many threads at once, but not while deserializing or changing settings
+	void apply(std::shared_ptr<luxem::value> &target, bool reverse = false) const;
+
+	// Like apply, but applies the last transform while writing target to writer, generating its output
+	// straight into writer rather than building it.  Leaves target with every transform but the last
+	// applied.  If the last transform isn't emittable, applies it then writes target.
+	void apply_and_write(std::shared_ptr<luxem::value> &target, luxem::writer &writer, bool reverse = false) const;
+
+	// True if the last transform has no scope or subtransforms, isn't bottom up, and if it reenters can't
+	// match anything it generates other than captured subtrees
+	bool emittable(bool reverse = false) const;
+
+	// Validates, then returns a job that applies the transforms a bounded amount of work at a time, so an
+	// event loop can interleave other work.  Gives the same result as apply.  The list and target must
+	// outlive the job, and target must not be touched until resume returns apply_done.  Summarizing and
+	// indexing the target happen up front, outside the quota.
+	apply_job begin_apply(std::shared_ptr<luxem::value> &target, bool reverse = false) const;
+
+	// Simplifies the loaded transforms in both directions without changing their results, dropping ones
+	// that can't change anything.  Reports each change if verbose.  Call after loading, before applying.
+	void optimize(void);
+
+	// Throws if any transform can't be applied in this direction; see transform::validate
+	void validate(bool reverse = false) const;
+
+	// True if no transform can match a root array; see transform::streamable
+	bool streamable(bool reverse = false) const;
+
+	// Applies every transform to one element of a root array, only valid if streamable
+	void apply_element(std::shared_ptr<luxem::value> &element, size_t index, bool reverse = false) const;
+
+	// Combines apply_element and apply_and_write
+	void apply_element_and_write(
+		std::shared_ptr<luxem::value> &element, 
+		size_t index, 
+		luxem::writer &writer, 
+		bool reverse = false) const;
 
 	private:
+		friend struct apply_state;
+
+		std::shared_ptr<transform_index const> get_index(bool reverse) const;
+		void apply(std::shared_ptr<luxem::value> &target, bool reverse, bool element, size_t index) const;
+		void apply_and_write(
+			std::shared_ptr<luxem::value> &target, 
+			luxem::writer &writer, 
+			bool reverse, 
+			bool element, 
+			size_t index) const;
+
 		bool verbose;
+		traversal_order default_traversal;
+		std::shared_ptr<transform_memo> memo;
+		std::shared_ptr<output_pool> pool;
+		std::shared_ptr<transform_profile> profile;
+		bool summarize = false;
 		std::list<std::unique_ptr<transform>> transforms;
+		mutable std::shared_ptr<transform_index const> indexes[2]; // Forward and reverse
+		mutable std::mutex index_mutex;
+};
+
+// Writes values in a compact binary encoding, with types and keys stored once in a string table.  Output
+// goes to file or callback after each value, or accumulates for dump.
+struct binary_writer
+{
+	binary_writer(void);
+	binary_writer(FILE *file);
+	binary_writer(std::function<void(char const *data, size_t length)> &&callback);
+
+	binary_writer &value(luxem::value const &data);
+	std::string dump(void);
+
+	private:
+		void write_varint(uint64_t value);
+		void write_string(std::string const &text);
+		void write_value(luxem::value const &data);
+
+		FILE *file = nullptr;
+		std::function<void(char const *data, size_t length)> callback;
+		std::string buffer;
+		bool started = false;
+		std::unordered_map<std::string, size_t> table;
+};
+
+// Reads values written by binary_writer, passing each root value to the build_struct callback
+struct binary_reader
+{
+	binary_reader &build_struct(std::function<void(std::shared_ptr<luxem::value> &&data)> &&callback);
+
+	// Returns the number of bytes consumed.  The rest, an incomplete element, must be fed again with more data.
+	// Parts of a root value already read are kept, so each byte is read about once however it's split.
+	size_t feed(char const *data, size_t length, bool finish);
+	size_t feed(std::string const &data, bool finish = true);
+
+	private:
+		uint64_t read_varint(char const *&position, char const *end);
+		std::string read_bytes(char const *&position, char const *end);
+		std::string read_string(char const *&position, char const *end);
+		void read_element(char const *&position, char const *end);
+
+		std::function<void(std::shared_ptr<luxem::value> &&data)> callback;
+		bool started = false;
+		std::vector<std::string> table;
+
+		// The root value being read and its unfinished containers, kept between feeds
+		struct frame
+		{
+			luxem::value *container;
+			uint64_t remaining;
+		};
+		std::vector<frame> stack;
+		std::shared_ptr<luxem::value> root;
 };
 
 }
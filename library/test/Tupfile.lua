@@ -7,7 +7,7 @@ do
 		Name = tup.base(Source),
 		Sources = Item(Source),
 		Objects = Luxemog,
-		LinkFlags = ' -lluxem-cxx'
+		LinkFlags = ' -lluxem-cxx -pthread'
 	}
 
 	Define.Test
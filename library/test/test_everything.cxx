@@ -1,7 +1,12 @@
 #include "../luxemog.h"
+#include "../../app/io.h"
 
 #include <iostream>
+#include <sstream>
 #include <memory>
+#include <thread>
+#include <vector>
+#include <sys/socket.h>
 
 template <typename type> void assert1(type const &value)
 {
@@ -50,9 +55,11 @@ void compare_value(luxem::value const &got, luxem::value const &expected)
 }
 
 
-std::unique_ptr<luxemog::transform_list> make_transforms(std::string const &text)
+std::unique_ptr<luxemog::transform_list> make_transforms(
+	std::string const &text, 
+	luxemog::traversal_order default_traversal = luxemog::traverse_reenter)
 {
-	auto transforms = std::make_unique<luxemog::transform_list>(true);
+	auto transforms = std::make_unique<luxemog::transform_list>(true, default_traversal);
 	luxem::reader reader;
 	reader.element([&transforms](std::shared_ptr<luxem::value> &&value) mutable 
 		{ transforms->deserialize(std::move(value)); });
@@ -60,31 +67,42 @@ std::unique_ptr<luxemog::transform_list> make_transforms(std::string const &text
 	return std::move(transforms);
 }
 
-void test(std::string const &transform_source, std::string const &source, std::string const &expected)
+void test(
+	std::string const &transform_source, 
+	std::string const &source, 
+	std::string const &expected, 
+	luxemog::traversal_order default_traversal = luxemog::traverse_reenter,
+	size_t memo_capacity = 0)
 {
-	auto transforms = make_transforms(transform_source);
-	std::shared_ptr<luxem::value> working_tree, expected_tree;
-	
+	// Subtree summaries must never change the result
+	for (bool summarize : {false, true})
 	{
-		luxem::reader reader;
-		reader.build_struct([&](std::shared_ptr<luxem::value> &&value) mutable 
-			{ working_tree = std::move(value); });
-		reader.feed(source);
-	}
+		auto transforms = make_transforms(transform_source, default_traversal);
+		transforms->set_memo_capacity(memo_capacity);
+		transforms->set_subtree_summaries(summarize);
+		std::shared_ptr<luxem::value> working_tree, expected_tree;
+		
+		{
+			luxem::reader reader;
+			reader.build_struct([&](std::shared_ptr<luxem::value> &&value) mutable 
+				{ working_tree = std::move(value); });
+			reader.feed(source);
+		}
 
-	{
-		luxem::reader reader;
-		reader.build_struct([&](std::shared_ptr<luxem::value> &&value) mutable 
-			{ expected_tree = std::move(value); });
-		reader.feed(expected);
-	}
+		{
+			luxem::reader reader;
+			reader.build_struct([&](std::shared_ptr<luxem::value> &&value) mutable 
+				{ expected_tree = std::move(value); });
+			reader.feed(expected);
+		}
 
-	transforms->apply(working_tree);
+		transforms->apply(working_tree);
 
-	std::cout << "\nGot:\n" << luxem::writer().set_pretty().value(*working_tree).dump() <<
-		"\nExpected:\n" << luxem::writer().set_pretty().value(*expected_tree).dump() << std::endl;
+		std::cout << "\nGot:\n" << luxem::writer().set_pretty().value(*working_tree).dump() <<
+			"\nExpected:\n" << luxem::writer().set_pretty().value(*expected_tree).dump() << std::endl;
 
-	compare_value(*working_tree, *expected_tree);
+		compare_value(*working_tree, *expected_tree);
+	}
 }
 
 void test_primitives(void)
@@ -287,6 +305,22 @@ void test_arrays(void)
 		"[2, 5]",
 		"[2, 5]"
 	);
+	
+	test
+	(
+		"["
+			"{"
+				"from: [2, 5],"
+				"to: 334,"
+			"},"
+			"{"
+				"from: {a: 2, b: 5},"
+				"to: 335,"
+			"},"
+		"]",
+		"[[2, 6], {a: 2, b: 6}, [2, 5], {a: 2, b: 5}]",
+		"[[2, 6], {a: 2, b: 6}, 334, 335]"
+	);
 }
 
 void test_wildcards(void)
@@ -463,6 +497,124 @@ void test_alts(void)
 		assert(false);
 	}
 	catch (std::runtime_error &error) {}
+	
+	test
+	(
+		"["
+			"{"
+				"from: (*alt) [(*regex) {id: g, exp: .*}],"
+				"to: (*string) \"<g>!\","
+			"},"
+		"]",
+		"hi",
+		"\"hi!\""
+	);
+	
+	test
+	(
+		"["
+			"{"
+				"from: (*alt) [(*match) {id: x, pattern: 4}],"
+				"to: 5,"
+			"},"
+		"]",
+		"[4, 3]",
+		"[5, 3]"
+	);
+
+	test
+	(
+		"["
+			"{"
+				"from: (*alt) {"
+					"adaptive: true,"
+					"patterns: [1, 7, {a: 1}, (t) 1, [(*match) x, 2], [(*match) x, 3]],"
+				"},"
+				"to: 9,"
+			"},"
+		"]",
+		"[7, (t) 1, 3, {a: 1}, {a: 2}]",
+		"[9, 9, 3, 9, {a: 2}]"
+	);
+	
+	test
+	(
+		"["
+			"{"
+				"from: (*alt) {"
+					"adaptive: true,"
+					"exclusive: true,"
+					"patterns: [(*regex) ^a, (*regex) ^b],"
+				"},"
+				"to: 9,"
+			"},"
+		"]",
+		"banana",
+		"9"
+	);
+	
+	try
+	{
+		make_transforms
+		(
+			"["
+				"{"
+					"from: (*alt) {"
+						"adaptive: true,"
+						"patterns: [(*wild), 1],"
+					"},"
+					"to: 9,"
+				"},"
+			"]"
+		);
+		assert(false);
+	}
+	catch (std::runtime_error &error) {}
+
+	{
+		auto transforms = make_transforms
+		(
+			"["
+				"{"
+					"from: (*alt) {"
+						"adaptive: true,"
+						"patterns: [1, 2, 3],"
+					"},"
+					"to: 9,"
+				"},"
+			"]"
+		);
+		for (size_t index = 0; index < 3000; ++index)
+		{
+			std::shared_ptr<luxem::value> tree = std::make_shared<luxem::primitive>(index % 7 ? "3" : "4");
+			transforms->apply(tree);
+			assert2(tree->as<luxem::primitive>().get_primitive(), std::string(index % 7 ? "9" : "4"));
+		}
+	}
+	
+	test
+	(
+		"["
+			"{"
+				"from: (*alt) [a, b, c, d, e, f, (t) g, {h: 1}, [i], (*match) {id: x, pattern: j}],"
+				"to: 9,"
+			"},"
+		"]",
+		"[a, (t) a, g, (t) g, {h: 1}, {h: 2}, [i], [i, i], j, k]",
+		"[9, (t) a, g, 9, 9, {h: 2}, 9, [i, i], 9, k]"
+	);
+	
+	test
+	(
+		"["
+			"{"
+				"from: (*alt) [a, (*regex) {id: r, exp: \"^(.*)$\"}, b, c, d, e, f, g, h, i],"
+				"to: (*string) \"<r>!\","
+			"},"
+		"]",
+		"[b, zz]",
+		"[\"b!\", \"zz!\"]"
+	);
 }
 
 void test_subtransforms(void)
@@ -500,6 +652,40 @@ void test_subtransforms(void)
 		"{y: 7}",
 		"{y: 7}"
 	);
+
+	// Independent subtransforms share one traversal
+	test
+	(
+		"["
+			"{"
+				"from: {version: 1, body: (*match) body},"
+				"to: {version: 2, body: (*match) body},"
+				"subtransforms: ["
+					"{from: old_a, to: new_a},"
+					"{from: old_b, to: new_b},"
+					"{from: {name: (*match) name, kind: x}, to: {title: (*match) name}},"
+				"],"
+			"},"
+		"]",
+		"{version: 1, body: [old_a, {name: old_b, kind: x}, [old_b, {name: {name: old_a, kind: x}, kind: x}]]}",
+		"{version: 2, body: [new_a, {title: new_b}, [new_b, {title: {title: new_a}}]]}"
+	);
+
+	// The second depends on the first's output everywhere, so they run in sequence
+	test
+	(
+		"["
+			"{"
+				"from: {x: (*match) value},"
+				"subtransforms: ["
+					"{from: a, to: b},"
+					"{from: {k: b}, to: c},"
+				"],"
+			"},"
+		"]",
+		"{x: {k: a}}",
+		"{x: c}"
+	);
 }
 
 void test_regexes(void)
@@ -527,6 +713,16 @@ void test_regexes(void)
 		"a",
 		"a"
 	);
+
+	// Groups don't need ids unless ids are given
+	test("[{from: (*regex) \"^(a|b)$\", to: ok}]", "a", "ok");
+
+	try
+	{
+		make_transforms("[{from: (*regex) {exp: \"^(a)(b)$\", ids: [all]}, to: ok}]");
+		assert(false);
+	}
+	catch (std::runtime_error &error) {}
 	
 	test
 	(
@@ -557,6 +753,71 @@ void test_regexes(void)
 		"(a) asparagus",
 		"(a) asparagus"
 	);
+
+	// Captures point into the replaced tree, which must outlive generating nested output
+	test
+	(
+		"["
+			"{"
+				"from: (*type_regex) {"
+					"type: {exp: \"^(.*)_v1$\", ids: [null, kind]},"
+					"value: {name: (*regex) {exp: \"^(.*)$\", ids: [null, name]}, old: (*regex) {exp: \"x\", id: gone, sub: y}},"
+				"},"
+				"to: [{label: (*string) \"<kind>:<name>\"}, (*string) \"<gone>\", (*type) {type: \"<kind>_v2\", value: {}}],"
+			"},"
+		"]",
+		"(point_v1) {name: origin, old: xx}",
+		"[{label: \"point:origin\"}, yy, (point_v2) {}]"
+	);
+}
+
+void test_regex_pool(void)
+{
+	auto before = luxemog::get_regex_pool_stats();
+	auto transforms = make_transforms
+	(
+		"["
+			"{from: (*regex) \"^pool1$\", to: one},"
+			"{from: (*regex) {exp: \"^pool1$\"}, to: two},"
+			"{from: (*regex) \"^pool2$\", to: three},"
+			"{from: (*regex) \"^pool3$\", to: never},"
+		"]"
+	);
+	auto loaded = luxemog::get_regex_pool_stats();
+	assert2(loaded.entries, before.entries + 3);
+	assert2(loaded.compiled, before.compiled);
+
+	std::shared_ptr<luxem::value> tree = std::make_shared<luxem::primitive>("pool1");
+	transforms->apply(tree);
+	assert2(tree->as<luxem::primitive>().get_primitive(), std::string("one"));
+	auto used = luxemog::get_regex_pool_stats();
+	assert2(used.compiled, before.compiled + 3);
+
+	// Expired regexes are no longer counted
+	transforms.reset();
+	auto released = luxemog::get_regex_pool_stats();
+	assert2(released.entries, before.entries);
+	assert2(released.compiled, before.compiled);
+
+	// Bad syntax is reported at load, without compiling
+	auto load_error = [](std::string const &pattern)
+	{
+		std::string text;
+		try
+		{
+			make_transforms("[{from: (*regex) \"" + pattern + "\", to: x}]");
+			assert(false);
+		}
+		catch (std::runtime_error &error) { text = error.what(); }
+		return text;
+	};
+	assert2(load_error("^pool["), std::string("Invalid regex '^pool[': unmatched '[' at 6."));
+	assert2(load_error("a{3,2}"), std::string("Invalid regex 'a{3,2}': bad repeat range at 5."));
+	assert2(load_error("(a)\\\\2"), std::string("Invalid regex '(a)\\2': bad back reference at 5."));
+	assert2(load_error("[z-a]"), std::string("Invalid regex '[z-a]': bad range at 4."));
+	assert2(load_error("*a"), std::string("Invalid regex '*a': nothing to repeat at 1."));
+	assert2(luxemog::get_regex_pool_stats().compiled, before.compiled);
+	make_transforms("[{from: (*regex) \"^(a|[[:alpha:]\\\\d-])*?(?=x)\\\\1?$\", to: x}]");
 }
 
 void test_format(void)
@@ -623,6 +884,1112 @@ void test_format(void)
 		"\"emblem peaches\"",
 		"\"omblom poachos\""
 	);
+	
+	test
+	(
+		"["
+			"{"
+				"from: (*regex) {ids: [(null) x, a, b], exp: \"(.)(.)\"},"
+				"to: (*string) \"<b>-<a>-<b>\","
+			"},"
+		"]",
+		"xy",
+		"y-x-y"
+	);
+}
+
+void test_traversal(void)
+{
+	test
+	(
+		"["
+			"{"
+				"from: [(*match) x],"
+				"to: (*match) x,"
+			"},"
+		"]",
+		"[[[7]]]",
+		"[7]"
+	);
+	
+	test
+	(
+		"["
+			"{"
+				"from: [(*match) x],"
+				"to: (*match) x,"
+				"traversal: no_reenter,"
+			"},"
+		"]",
+		"[[[7]]]",
+		"[[7]]"
+	);
+	
+	test
+	(
+		"["
+			"{"
+				"from: [(*match) x],"
+				"to: (*match) x,"
+				"traversal: bottom_up,"
+			"},"
+		"]",
+		"[[[7]]]",
+		"7"
+	);
+	
+	test
+	(
+		"["
+			"{"
+				"from: [(*match) x],"
+				"to: (*match) x,"
+			"},"
+		"]",
+		"[[[7]]]",
+		"7",
+		luxemog::traverse_bottom_up
+	);
+	
+	test
+	(
+		"["
+			"{"
+				"from: [(*match) x],"
+				"to: (*match) x,"
+				"traversal: reenter,"
+			"},"
+		"]",
+		"[[[7]]]",
+		"[7]",
+		luxemog::traverse_no_reenter
+	);
+	
+	test
+	(
+		"["
+			"{"
+				"from: {x: (*match) value},"
+				"traversal: bottom_up,"
+				"subtransforms: ["
+					"{"
+						"from: 7,"
+						"to: 9,"
+					"},"
+				"],"
+			"},"
+		"]",
+		"{x: 7}",
+		"{x: 9}"
+	);
+}
+
+void test_scope(void)
+{
+	test
+	(
+		"["
+			"{"
+				"from: 1,"
+				"to: 2,"
+				"scope: [a, (*wild)],"
+			"},"
+		"]",
+		"{a: [1, {b: 1}], b: 1}",
+		"{a: [2, {b: 2}], b: 1}"
+	);
+	
+	test
+	(
+		"["
+			"{"
+				"from: 1,"
+				"to: 2,"
+				"scope: [a, (*index) 1],"
+			"},"
+		"]",
+		"{a: [1, 1, 1], b: [1, 1]}",
+		"{a: [1, 2, 1], b: [1, 1]}"
+	);
+	
+	test
+	(
+		"["
+			"{"
+				"from: 1,"
+				"to: 2,"
+				"scope: [(*deep), (*type) service],"
+			"},"
+		"]",
+		"[1, {x: (service) [1, 1], y: [(service) {z: 1}]}]",
+		"[1, {x: (service) [2, 2], y: [(service) {z: 2}]}]"
+	);
+	
+	test
+	(
+		"["
+			"{"
+				"from: [(*match) x],"
+				"to: (*match) x,"
+				"scope: [],"
+			"},"
+		"]",
+		"[[[7]]]",
+		"[7]"
+	);
+}
+
+void test_sequences(void)
+{
+	test
+	(
+		"[{from: (*seq) [(*rest) before, b, c, (*rest) after], to: [(*rest) after, x, (*rest) before]}]",
+		"[a, b, b, c, d, e]",
+		"[d, e, x, a, b]"
+	);
+	
+	test
+	(
+		"[{from: (*seq) [a, b, a, c], to: found}]",
+		"{x: [a, b, a, b, a, c, a], y: [a, b, a, b], z: [c]}",
+		"{x: found, y: [a, b, a, b], z: [c]}"
+	);
+	
+	test
+	(
+		"[{from: (*seq) [{k: 1}, [2]], to: found}]",
+		"[[{k: 1}, {k: 1}, [2]], [{k: 1}, [3]]]",
+		"[found, [{k: 1}, [3]]]"
+	);
+	
+	test
+	(
+		"[{from: (*seq) [(*rest) before, (*match) x, 3, (*rest) after], to: [(*rest) before, (*match) x]}]",
+		"[[1, 2, 3, 3, 4], [5, 6]]",
+		"[[1, 2], [5, 6]]"
+	);
+	
+	test
+	(
+		"[{from: (*seq) [(*rest) before, (*rest) after], to: [(*rest) before, (*rest) after, end]}]",
+		"[1, 2]",
+		"[1, 2, end]",
+		luxemog::traverse_no_reenter
+	);
+}
+
+void test_partial(void)
+{
+	test
+	(
+		"[{from: (*partial) {keys: {a: 1, b: (*match) b}}, to: {found: (*match) b}}]",
+		"[{a: 1, b: 2}, {a: 1, b: 3, c: 4}, {a: 1, c: 4}, {a: 2, b: 3, c: 4}]",
+		"[{found: 2}, {found: 3}, {a: 1, c: 4}, {a: 2, b: 3, c: 4}]"
+	);
+	
+	test
+	(
+		"[{from: (*partial) {keys: {name: (*match) name}, rest: others}, to: {id: (*match) name, others: (*rest) others}}]",
+		"{name: x, size: 3, tags: [t, u]}",
+		"{id: x, size: 3, tags: [t, u]}",
+		luxemog::traverse_no_reenter
+	);
+	
+	// The failed branch doesn't save its rest
+	try
+	{
+		test
+		(
+			"[{from: (*alt) [(*partial) {keys: {a: 7}, rest: r}, (*partial) {keys: {b: 1}}], to: (*match) r}]",
+			"{a: 1, b: 1}",
+			"IGNORED"
+		);
+		assert(false);
+	}
+	catch (std::runtime_error &error) {}
+
+	// Rests are spliced into the same kind of container they're captured from
+	auto splice_error = [](std::string const &transform_source)
+	{
+		std::string text;
+		try 
+		{ 
+			make_transforms(transform_source)->validate(); 
+			assert(false);
+		}
+		catch (std::runtime_error &error) { text = error.what(); }
+		return text;
+	};
+	assert2(
+		splice_error("[{from: (*partial) {keys: {a: 1}, rest: r}, to: [x, (*rest) r]}]"), 
+		std::string("Transform 0: Rest r is captured from an object by *partial and can't be spliced into an array "
+			"in 'to' patterns."));
+	assert2(
+		splice_error("[{from: (*seq) [(*rest) r, a], to: {k: {x: (*rest) r}}}]"), 
+		std::string("Transform 0: Rest r is captured from an array by *seq and can't be spliced into an object "
+			"in 'to' patterns."));
+
+	// Unless it could be either, which is checked when splicing
+	auto either = "[{from: (*alt) [(*partial) {keys: {a: 1}, rest: r}, (*seq) [(*rest) r, a]], to: [(*rest) r]}]";
+	test(either, "[b, a]", "[b]", luxemog::traverse_no_reenter);
+	try
+	{
+		test(either, "{a: 1, b: 2}", "IGNORED", luxemog::traverse_no_reenter);
+		assert(false);
+	}
+	catch (std::runtime_error &error) 
+	{ 
+		assert2(std::string(error.what()), std::string("Rest r can't be spliced into an array, it was captured from object."));
+	}
+}
+
+void test_memo(void)
+{
+	std::string const block = "{k: [1, 1, 1, 1], l: [1, 3, 1, 1], m: [1, 1, 1, 1]}";
+	std::string const done = "{k: [2, 2, 2, 2], l: [2, 3, 2, 2], m: [2, 2, 2, 2]}";
+
+	test
+	(
+		"[{from: 1, to: 2}]",
+		"[" + block + ", 1, " + block + ", [" + block + "]]",
+		"[" + done + ", 2, " + done + ", [" + done + "]]",
+		luxemog::traverse_reenter,
+		16
+	);
+	
+	test
+	(
+		"[{from: 1, to: 2}]",
+		"[" + block + ", " + block + "]",
+		"[" + done + ", " + done + "]",
+		luxemog::traverse_bottom_up,
+		16
+	);
+	
+	test
+	(
+		"[{from: 7, to: 2}]",
+		"[" + block + ", " + block + "]",
+		"[" + block + ", " + block + "]",
+		luxemog::traverse_reenter,
+		16
+	);
+
+	// A subtree changed by an earlier transform isn't memoized under its old hash
+	test
+	(
+		"[{from: 3, to: 5, scope: [(*index) 0]}, {from: 1, to: 2}]",
+		"[" + block + ", " + block + "]",
+		"[{k: [2, 2, 2, 2], l: [2, 5, 2, 2], m: [2, 2, 2, 2]}, " + done + "]",
+		luxemog::traverse_reenter,
+		16
+	);
+
+	// Reused across documents, and evicted when over capacity
+	for (size_t capacity : {1, 16})
+	{
+		auto transforms = make_transforms("[{from: 1, to: 2}, {from: 3, to: 4}]");
+		transforms->set_memo_capacity(capacity);
+		for (size_t repeat = 0; repeat < 3; ++repeat)
+		{
+			std::shared_ptr<luxem::value> working_tree, expected_tree;
+			{
+				luxem::reader reader;
+				reader.build_struct([&](std::shared_ptr<luxem::value> &&value) mutable 
+					{ working_tree = std::move(value); });
+				reader.feed("[" + block + ", " + block + "]");
+			}
+			{
+				luxem::reader reader;
+				reader.build_struct([&](std::shared_ptr<luxem::value> &&value) mutable 
+					{ expected_tree = std::move(value); });
+				reader.feed("[{k: [2, 2, 2, 2], l: [2, 4, 2, 2], m: [2, 2, 2, 2]}, {k: [2, 2, 2, 2], l: [2, 4, 2, 2], m: [2, 2, 2, 2]}]");
+			}
+			transforms->apply(working_tree);
+			compare_value(*working_tree, *expected_tree);
+		}
+	}
+}
+
+void test_share_output(void)
+{
+	auto read = [](std::string const &text)
+	{
+		std::shared_ptr<luxem::value> out;
+		luxem::reader reader;
+		reader.build_struct([&](std::shared_ptr<luxem::value> &&value) mutable 
+			{ out = std::move(value); });
+		reader.feed(text);
+		return out;
+	};
+
+	auto transforms = make_transforms
+	(
+		"["
+			"{from: 1, to: {x: [a, b, c]}},"
+			"{from: b, to: z, scope: [(*index) 0, x, (*index) 1]},"
+		"]"
+	);
+	transforms->set_share_output(true);
+
+	auto working_tree = read("[1, 1, 1]");
+	transforms->apply(working_tree);
+	compare_value(*working_tree, *read("[{x: [a, z, c]}, {x: [a, b, c]}, {x: [a, b, c]}]"));
+	auto &data = working_tree->as<luxem::array>().get_data();
+	assert(data[0] != data[1]);
+	assert(data[1] == data[2]);
+	auto &first_x = data[0]->as<luxem::object>().get_data().at("x")->as<luxem::array>().get_data();
+	auto &second_x = data[1]->as<luxem::object>().get_data().at("x")->as<luxem::array>().get_data();
+	assert(first_x[0] == second_x[0]);
+	assert(first_x[1] != second_x[1]);
+
+	// Shared across documents
+	auto other_tree = read("[1]");
+	transforms->apply(other_tree);
+	assert(other_tree->as<luxem::array>().get_data()[0] != data[1]);
+	compare_value(*other_tree, *read("[{x: [a, z, c]}]"));
+	auto third_tree = read("{k: 1}");
+	transforms->apply(third_tree);
+	assert(third_tree->as<luxem::object>().get_data().at("k") == data[1]);
+
+	// Still copied when shared after enough nodes to sweep the pool
+	auto wrap_transforms = make_transforms
+	(
+		"["
+			"{from: (*regex) {exp: \"^v.*\", id: v}, to: [(*string) \"w<v>\"]},"
+			"{from: wv7, to: seven, scope: [(*index) 0, (*index) 0]},"
+		"]"
+	);
+	wrap_transforms->set_share_output(true);
+	std::string many = "[x";
+	for (size_t index = 0; index < 5000; ++index) many += ", v" + std::to_string(index);
+	auto many_tree = read(many + "]");
+	wrap_transforms->apply(many_tree);
+	auto &many_data = many_tree->as<luxem::array>().get_data();
+	compare_value(*many_data[8], *read("[wv7]"));
+	auto seven_tree = read("[v7]");
+	wrap_transforms->apply(seven_tree);
+	compare_value(*seven_tree, *read("[[seven]]"));
+	compare_value(*many_data[8], *read("[wv7]"));
+}
+
+void test_concurrent_apply(void)
+{
+	auto read = [](std::string const &text)
+	{
+		std::shared_ptr<luxem::value> out;
+		luxem::reader reader;
+		reader.build_struct([&](std::shared_ptr<luxem::value> &&value) mutable 
+			{ out = std::move(value); });
+		reader.feed(text);
+		return out;
+	};
+
+	// One set, shared by every thread, exercising the specials with internal state
+	luxemog::transform_list transforms;
+	{
+		luxem::reader reader;
+		reader.element([&transforms](std::shared_ptr<luxem::value> &&value) mutable 
+			{ transforms.deserialize(std::move(value)); });
+		reader.feed(
+			"["
+				"{from: (*alt) {patterns: [a, b, c], adaptive: true}, to: letter},"
+				"{from: (*regex) {exp: \"^n(.*)\", ids: [all, rest]}, to: (*string) \"<rest>\"},"
+				"{from: (*seq) [(*rest) before, x, (*rest) after], to: [(*rest) after, (*rest) before]},"
+				"{from: (*partial) {keys: {k: (*match) k}}, to: (*match) k},"
+			"]");
+	}
+	transforms.set_memo_capacity(16);
+	transforms.set_share_output(true);
+
+	std::string const source = "[a, n1, [p, x, q], {k: b, l: 2}, c, a, [1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1]]";
+	size_t const thread_count = 8, repeat_count = 500;
+	std::vector<std::vector<std::shared_ptr<luxem::value>>> results(thread_count);
+	std::vector<std::thread> threads;
+	for (size_t thread = 0; thread < thread_count; ++thread)
+	{
+		threads.emplace_back([&, thread](void)
+		{
+			for (size_t repeat = 0; repeat < repeat_count; ++repeat)
+			{
+				auto working_tree = read(source);
+				transforms.apply(working_tree);
+				results[thread].push_back(std::move(working_tree));
+			}
+		});
+	}
+	for (auto &thread : threads) thread.join();
+
+	auto expected_tree = read("[letter, 1, [q, p], letter, letter, letter, [1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1]]");
+	for (auto &thread_results : results)
+		for (auto &result : thread_results) compare_value(*result, *expected_tree);
+}
+
+void test_stream_elements(void)
+{
+	assert(make_transforms("[{from: a, to: b}]")->streamable());
+	assert(make_transforms("[{from: (*regex) {exp: \"a+\"}, to: b}]")->streamable());
+	assert(make_transforms("[{from: (*partial) {keys: {k: a}}, to: b}]")->streamable());
+	assert(make_transforms("[{from: [a], to: b, scope: [(*wild)]}]")->streamable());
+	assert(!make_transforms("[{from: [a], to: b}]")->streamable());
+	assert(!make_transforms("[{from: (*wild) x, to: b}]")->streamable());
+	assert(!make_transforms("[{from: (*alt) [a, [b]], to: b}]")->streamable());
+	assert(!make_transforms("[{from: a, to: [b]}]")->streamable(true));
+	assert(!make_transforms("[{from: (*match) x, to: b, matches: [(*match) {id: x}]}]")->streamable());
+
+	auto read = [](std::string const &text)
+	{
+		std::shared_ptr<luxem::value> out;
+		luxem::reader reader;
+		reader.build_struct([&](std::shared_ptr<luxem::value> &&value) mutable 
+			{ out = std::move(value); });
+		reader.feed(text);
+		return out;
+	};
+
+	// Each element transforms as it would in place, including scopes that start at the root
+	auto transforms = make_transforms
+	(
+		"["
+			"{from: a, to: b},"
+			"{from: b, to: c, scope: [(*index) 1]},"
+		"]"
+	);
+	auto whole_tree = read("[a, a, [a]]");
+	transforms->apply(whole_tree);
+	auto &whole_data = whole_tree->as<luxem::array>().get_data();
+	auto elements_tree = read("[a, a, [a]]");
+	auto &element_data = elements_tree->as<luxem::array>().get_data();
+	for (size_t index = 0; index < element_data.size(); ++index) 
+	{
+		transforms->apply_element(element_data[index], index);
+		compare_value(*element_data[index], *whole_data[index]);
+	}
+	compare_value(*elements_tree, *read("[b, c, [b]]"));
+}
+
+void test_binary(void)
+{
+	std::vector<std::shared_ptr<luxem::value>> source;
+	{
+		luxem::reader reader;
+		reader.build_struct([&](std::shared_ptr<luxem::value> &&value) mutable 
+			{ source.push_back(std::move(value)); });
+		reader.feed("(list) [a, {k: \"\", j: (t) [1, (t) x]}, [], {}] x {k: {k: (t) k}}");
+	}
+
+	luxemog::binary_writer writer;
+	for (auto &value : source) writer.value(*value);
+	auto encoded = writer.dump();
+
+	// Whole, then a byte at a time keeping unconsumed bytes as feed_file does
+	for (size_t chunk : {encoded.size(), size_t(1)})
+	{
+		std::vector<std::shared_ptr<luxem::value>> decoded;
+		luxemog::binary_reader reader;
+		reader.build_struct([&](std::shared_ptr<luxem::value> &&value) mutable 
+			{ decoded.push_back(std::move(value)); });
+		std::string pending;
+		for (size_t start = 0; start < encoded.size(); start += chunk)
+		{
+			pending += encoded.substr(start, chunk);
+			bool const finish = start + chunk >= encoded.size();
+			pending.erase(0, reader.feed(pending.data(), pending.size(), finish));
+		}
+		assert1(pending.empty());
+		assert2(decoded.size(), source.size());
+		for (size_t index = 0; index < source.size(); ++index) compare_value(*decoded[index], *source[index]);
+	}
+
+	// One large value in pipe-sized pieces is consumed as it arrives, rather than kept until complete
+	{
+		auto large = std::make_shared<luxem::array>();
+		for (size_t index = 0; index < 100000; ++index)
+		{
+			auto element = std::make_shared<luxem::object>();
+			element->get_data()["k"] = std::make_shared<luxem::primitive>(std::to_string(index));
+			large->get_data().push_back(element);
+		}
+		luxemog::binary_writer large_writer;
+		large_writer.value(*large);
+		auto large_encoded = large_writer.dump();
+
+		std::shared_ptr<luxem::value> decoded;
+		luxemog::binary_reader reader;
+		reader.build_struct([&](std::shared_ptr<luxem::value> &&value) mutable { decoded = std::move(value); });
+		size_t const chunk = 4096;
+		std::string pending;
+		for (size_t start = 0; start < large_encoded.size(); start += chunk)
+		{
+			pending += large_encoded.substr(start, chunk);
+			bool const finish = start + chunk >= large_encoded.size();
+			pending.erase(0, reader.feed(pending.data(), pending.size(), finish));
+			assert1(pending.size() < 64);
+		}
+		assert1(decoded != nullptr);
+		compare_value(*decoded, *large);
+	}
+
+	bool failed = false;
+	try { luxemog::binary_reader().feed(encoded.substr(0, encoded.size() - 1), true); }
+	catch (std::runtime_error &error) { failed = true; }
+	assert1(failed);
+}
+
+void test_profile(void)
+{
+	auto transforms = make_transforms
+	(
+		"["
+			"{from: {k: (*alt) [(*regex) {exp: \"a+\"}, b]}, to: x},"
+		"]"
+	);
+	transforms->set_profiling(true);
+	std::shared_ptr<luxem::value> tree;
+	{
+		luxem::reader reader;
+		reader.build_struct([&](std::shared_ptr<luxem::value> &&value) mutable { tree = std::move(value); });
+		reader.feed("[{k: aa}, {k: b}, {k: c}, q]");
+	}
+	transforms->apply(tree);
+
+	std::stringstream attempts;
+	transforms->write_profile(attempts, true);
+	assert2(attempts.str(), std::string(
+		"transform 0;from object 6\n"
+		"transform 0;from object;k *alt 3\n"
+		"transform 0;from object;k *alt;branch 0 *regex 3\n"
+		"transform 0;from object;k *alt;branch 1 primitive 2\n"));
+
+	std::stringstream times;
+	transforms->write_profile(times);
+	assert1(times.str().find("transform 0;from object;k *alt;branch 0 *regex ") != std::string::npos);
+}
+
+void test_subtree_summaries(void)
+{
+	auto read = [](std::string const &text)
+	{
+		std::shared_ptr<luxem::value> out;
+		luxem::reader reader;
+		reader.build_struct([&](std::shared_ptr<luxem::value> &&value) mutable 
+			{ out = std::move(value); });
+		reader.feed(text);
+		return out;
+	};
+
+	// Subtrees without the key aren't scanned
+	for (bool summarize : {false, true})
+	{
+		auto transforms = make_transforms("[{from: {name: x}, to: y}]");
+		transforms->set_subtree_summaries(summarize);
+		transforms->set_profiling(true);
+		auto tree = read("[{a: [1, 2, {b: 3}]}, {name: x}]");
+		transforms->apply(tree);
+		compare_value(*tree, *read("[{a: [1, 2, {b: 3}]}, y]"));
+		std::stringstream attempts;
+		transforms->write_profile(attempts, true);
+		assert2(attempts.str(), std::string(summarize ? 
+			"transform 0;from object 2\n" 
+			"transform 0;from object;name primitive 1\n" :
+			"transform 0;from object 8\n" 
+			"transform 0;from object;name primitive 1\n"));
+	}
+
+	// Summaries of trees changed by earlier transforms and subtransforms are discarded
+	test
+	(
+		"["
+			"{from: a, to: {name: x}},"
+			"{from: {name: x}, to: y},"
+		"]",
+		"[[a], [b]]",
+		"[[y], [b]]"
+	);
+	test
+	(
+		"["
+			"{"
+				"from: {k: (*match) x}, to: {k: (*match) x},"
+				"subtransforms: [{from: a, to: {name: x}}, {from: {name: x}, to: y}],"
+			"},"
+		"]",
+		"{k: [[a]]}",
+		"{k: [[y]]}"
+	);
+}
+
+void test_transform_index(void)
+{
+	// Enough transforms to be indexed; later ones see what earlier ones generate
+	std::string const source =
+		"["
+			"{from: a, to: {name: x}},"
+			"{from: z1, to: q}, {from: z2, to: q}, {from: z3, to: q}, {from: (*regex) {exp: \"z.*\"}, to: q},"
+			"{from: (*partial) {keys: {z: z}}, to: q}, {from: (t) [z], to: q},"
+			"{from: {name: x}, to: y},"
+			"{from: (*match) w, to: (*match) w, matches: [(*match) {id: w}], traversal: no_reenter},"
+		"]";
+	test(source, "[a, b]", "[y, b]");
+
+	auto transforms = make_transforms(source);
+	transforms->set_profiling(true);
+	std::shared_ptr<luxem::value> tree;
+	{
+		luxem::reader reader;
+		reader.build_struct([&](std::shared_ptr<luxem::value> &&value) mutable { tree = std::move(value); });
+		reader.feed("[a, b]");
+	}
+	transforms->apply(tree);
+
+	// Only transforms that could match some node were scanned
+	std::stringstream attempts;
+	transforms->write_profile(attempts, true);
+	std::string const text = attempts.str();
+	assert1(text.find("transform 0;") != std::string::npos);
+	assert1(text.find("transform 1;") == std::string::npos);
+	assert1(text.find("transform 4;") != std::string::npos);
+	assert1(text.find("transform 5;") != std::string::npos); // Any object, once transform 0 makes one
+	assert1(text.find("transform 6;") == std::string::npos);
+	assert1(text.find("transform 7;") != std::string::npos);
+	assert1(text.find("transform 8;") != std::string::npos);
+}
+
+void test_validate(void)
+{
+	auto transforms = make_transforms(
+		"["
+			"{from: x, to: y},"
+			"{from: (*regex) {exp: \"a.*\"}, to: b},"
+		"]");
+	transforms->validate();
+
+	// Rejected before anything changes
+	std::string text;
+	try 
+	{ 
+		transforms->validate(true); 
+		assert(false);
+	}
+	catch (std::runtime_error &error) { text = error.what(); }
+	assert2(text, std::string("Transform 1: *regex cannot be used in 'from' patterns when reversing."));
+
+	std::shared_ptr<luxem::value> tree = std::make_shared<luxem::primitive>("y");
+	try 
+	{ 
+		transforms->apply(tree, true); 
+		assert(false);
+	}
+	catch (std::runtime_error &error) {}
+	compare_value(*tree, luxem::primitive("y"));
+
+	// Subtransforms are checked with their parent
+	auto nested = make_transforms(
+		"["
+			"{from: a, to: b, subtransforms: [{from: b, to: (*wild) {}}]},"
+		"]");
+	try 
+	{ 
+		nested->validate(); 
+		assert(false);
+	}
+	catch (std::runtime_error &error) { text = error.what(); }
+	assert2(text, std::string("Transform 0: *wild cannot be used in 'to' patterns."));
+	nested->validate(true);
+}
+
+void test_optimize(void)
+{
+	auto transforms = make_transforms(
+		"["
+			"{from: (*alt) [{name: (*match) n}], to: {title: (*match) n}},"
+			"{from: {name: (*match) n}, to: {title: (*match) n}},"
+			"{from: (*string) never, to: y},"
+			"{from: {k: (*match) unused}, to: done},"
+			"{from: (*type_regex) {type: \"^point$\", value: {x: (*match) x}}, to: (*match) x},"
+			"{from: q},"
+			"{from: z1, to: z2},"
+			"{from: z3, to: z4},"
+		"]");
+	transforms->optimize();
+	transforms->validate();
+
+	std::shared_ptr<luxem::value> tree, expected;
+	{
+		luxem::reader reader;
+		reader.build_struct([&](std::shared_ptr<luxem::value> &&value) mutable { tree = std::move(value); });
+		reader.feed("[{name: a}, (point) {x: 1}, (line) {x: 2}, {k: 2}, x, q, z1]");
+	}
+	{
+		luxem::reader reader;
+		reader.build_struct([&](std::shared_ptr<luxem::value> &&value) mutable { expected = std::move(value); });
+		reader.feed("[{title: a}, 1, (line) {x: 2}, done, x, q, z2]");
+	}
+	transforms->set_profiling(true);
+	transforms->apply(tree);
+	compare_value(*tree, *expected);
+
+	// Dropped transforms are never scanned
+	std::stringstream attempts;
+	transforms->write_profile(attempts, true);
+	std::string const text = attempts.str();
+	assert1(text.find("transform 0;") != std::string::npos);
+	assert1(text.find("transform 1;") == std::string::npos);
+	assert1(text.find("transform 2;") == std::string::npos);
+	assert1(text.find("transform 5;") == std::string::npos);
+	assert1(text.find("transform 0;from object ") != std::string::npos); // The flattened *alt
+	assert1(text.find("transform 4;from object ") != std::string::npos); // The folded *type_regex
+}
+
+void test_resumable_apply(void)
+{
+	auto read = [](std::string const &text)
+	{
+		std::shared_ptr<luxem::value> out;
+		luxem::reader reader;
+		reader.build_struct([&](std::shared_ptr<luxem::value> &&value) mutable 
+			{ out = std::move(value); });
+		reader.feed(text);
+		return out;
+	};
+
+	auto transforms = make_transforms(
+		"["
+			"{from: (*alt) [a, b], to: letter},"
+			"{from: {k: (*match) k}, to: [(*match) k, (*match) k]},"
+			"{from: letter, to: done},"
+		"]");
+
+	// Big enough to need many thousands of steps
+	std::string source = "[", expected_text = "[";
+	for (size_t index = 0; index < 2000; ++index)
+	{
+		source += "a, {k: b}, c, ";
+		expected_text += "done, [done, done], c, ";
+	}
+	source += "]";
+	expected_text += "]";
+	auto const expected = read(expected_text);
+
+	auto blocking = read(source);
+	transforms->apply(blocking);
+	compare_value(*blocking, *expected);
+
+	// Two documents interleaved with small quotas, as an event loop would
+	auto first = read(source), second = read("[{k: a}, x]");
+	auto first_job = transforms->begin_apply(first);
+	auto second_job = transforms->begin_apply(second);
+	size_t resumes = 0;
+	bool first_done = false, second_done = false;
+	while (!first_done || !second_done)
+	{
+		if (!first_done) first_done = first_job.resume(7) == luxemog::apply_done;
+		if (!second_done) second_done = second_job.resume(1) == luxemog::apply_done;
+		++resumes;
+	}
+	assert1(resumes > 100);
+	assert2(first_job.resume(1), luxemog::apply_done);
+	compare_value(*first, *expected);
+	compare_value(*second, *read("[[done, done], x]"));
+
+	// Nothing changes until resumed
+	auto untouched = read("[a]");
+	auto job = transforms->begin_apply(untouched);
+	compare_value(*untouched, *read("[a]"));
+	assert2(job.resume(0), luxemog::apply_pending);
+	while (job.resume(1) == luxemog::apply_pending) {}
+	compare_value(*untouched, *read("[done]"));
+}
+
+void test_emit(void)
+{
+	auto read = [](std::string const &text)
+	{
+		std::shared_ptr<luxem::value> out;
+		luxem::reader reader;
+		reader.build_struct([&](std::shared_ptr<luxem::value> &&value) mutable 
+			{ out = std::move(value); });
+		reader.feed(text);
+		return out;
+	};
+
+	// Writing while applying the last transform must match applying then writing
+	auto check = [&](
+		std::string const &transform_source, 
+		std::string const &source, 
+		bool emittable,
+		luxemog::traversal_order traversal = luxemog::traverse_reenter,
+		bool summarize = false)
+	{
+		auto transforms = make_transforms(transform_source, traversal);
+		transforms->set_subtree_summaries(summarize);
+		assert2(transforms->emittable(), emittable);
+
+		auto applied = read(source);
+		transforms->apply(applied);
+		luxem::writer expected;
+		expected.value(*applied);
+
+		auto emitted = read(source);
+		luxem::writer got;
+		transforms->apply_and_write(emitted, got);
+		assert2(got.dump(), expected.dump());
+		return emitted;
+	};
+
+	// Captured subtrees are scanned again when reentering
+	check(
+		"[{from: {k: (*match) k}, to: {wrapped: [(*match) k]}}]",
+		"[{k: {k: 1}}, {j: {k: 2}}, 3]",
+		true);
+	check(
+		"[{from: {k: (*match) k}, to: {wrapped: [(*match) k]}}]",
+		"[{k: {k: 1}}, {j: {k: 2}}, 3]",
+		true,
+		luxemog::traverse_no_reenter,
+		true);
+
+	// But not a captured replacement root itself
+	check("[{from: {k: (*match) k}, to: (*match) k}]", "{k: {k: {j: {k: 1}}}}", true);
+
+	// Spliced elements and keys
+	check(
+		"[{from: (*seq) [(*rest) before, b, (*rest) after], to: [(*rest) after, x, (*rest) before]}]",
+		"[a, b, c, [d, b]]",
+		true,
+		luxemog::traverse_no_reenter);
+	check(
+		"[{from: (*partial) {keys: {name: (*match) name}, rest: others}, to: {b: (*match) name, others: (*rest) others}}]",
+		"[{name: x, a: {name: z}, c: [2], b: 3}, {name: y}]",
+		true);
+
+	// Built strings and types
+	check(
+		"[{"
+			"from: {name: (*regex) {exp: \"^(.*)$\", ids: [all]}}, "
+			"to: [(*string) \"hi <all>\", (*type) {type: \"t_<all>\", value: {n: (*string) <all>}}]"
+		"}]",
+		"[{name: x}, (q) {name: y}]",
+		true,
+		luxemog::traverse_no_reenter);
+
+	// Matches without output
+	check("[{from: {k: (*match) k}}]", "[{k: {k: 1}}]", true);
+	check("[{from: {k: (*match) k}}]", "[{k: {k: 1}}]", true, luxemog::traverse_no_reenter);
+
+	// Bottom up can't be emitted, so it's applied first
+	check("[{from: [(*match) x], to: (*match) x}]", "[[[1]]]", false, luxemog::traverse_bottom_up);
+
+	// Earlier transforms are applied to the target, the last only written
+	auto partly = check("[{from: a, to: b}, {from: b, to: [c]}]", "[a, b]", true);
+	compare_value(*partly, *read("[b, b]"));
+
+	// Elements of a root array
+	auto transforms = make_transforms("[{from: a, to: b}, {from: b, to: {got: [c]}}]");
+	luxem::writer expected, got;
+	for (std::string const source : {"a", "b", "c"})
+	{
+		auto applied = read(source);
+		transforms->apply_element(applied, 0);
+		expected.value(*applied);
+		auto emitted = read(source);
+		transforms->apply_element_and_write(emitted, 0, got);
+	}
+	assert2(got.dump(), expected.dump());
+
+	// Profiling while emitting, including nested patterns scanned directly
+	{
+		auto source = "[{k: [1, {k: [2]}]}, {k: 3}]";
+		auto profiled = make_transforms("[{from: {k: [(*match) x, (*wild) y]}, to: (*match) x}]");
+		profiled->set_profiling(true);
+		auto applied = read(source);
+		profiled->apply(applied);
+		std::stringstream applied_profile;
+		profiled->write_profile(applied_profile, true);
+
+		profiled = make_transforms("[{from: {k: [(*match) x, (*wild) y]}, to: (*match) x}]");
+		profiled->set_profiling(true);
+		auto emitted = read(source);
+		luxem::writer expected, got;
+		expected.value(*applied);
+		profiled->apply_and_write(emitted, got);
+		assert2(got.dump(), expected.dump());
+		std::stringstream emitted_profile;
+		profiled->write_profile(emitted_profile, true);
+		assert2(emitted_profile.str(), applied_profile.str());
+	}
+}
+
+void test_cli_io(void)
+{
+	// Records what's fed, eating all but the last hold bytes until finished
+	struct recording_reader
+	{
+		size_t hold;
+		std::string fed;
+		size_t feeds = 0, finishes = 0;
+
+		size_t feed(char const *data, size_t length, bool finish)
+		{
+			++feeds;
+			if (finish) ++finishes;
+			size_t const eaten = finish ? length : (length > hold ? length - hold : 0);
+			fed.append(data, eaten);
+			return eaten;
+		}
+	};
+
+	char directory_template[] = "/tmp/luxemog_test_XXXXXX";
+	std::string const directory = mkdtemp(directory_template);
+	auto const empty = directory + "/empty", full = directory + "/full";
+
+	// Empty files can't be mapped, but are still finished
+	close(open(empty.c_str(), O_CREAT | O_WRONLY, 0600));
+	{
+		recording_reader reader{0};
+		feed_file(reader, empty);
+		assert2(reader.fed, std::string());
+		assert2(reader.feeds, size_t(1));
+		assert2(reader.finishes, size_t(1));
+	}
+
+	// Regular files are fed in one piece, here written through the buffered output
+	assert1(open_output(directory + "/missing/out") == nullptr);
+	{
+		auto file = open_output(full);
+		assert1(file != nullptr);
+		fputs("[a, b]", file);
+		close_output(file);
+		assert1(file == nullptr);
+		recording_reader reader{0};
+		feed_file(reader, full);
+		assert2(reader.fed, std::string("[a, b]"));
+		assert2(reader.feeds, size_t(1));
+	}
+
+	bool threw = false;
+	try { recording_reader reader{0}; feed_file(reader, directory + "/missing"); }
+	catch (std::runtime_error &) { threw = true; }
+	assert1(threw);
+
+	// Buffered output that can't be written is reported when closing
+	auto full_device = open_output("/dev/full");
+	assert1(full_device != nullptr);
+	fputs("[a, b]", full_device);
+	threw = false;
+	try { close_output(full_device); }
+	catch (std::runtime_error &) { threw = true; }
+	assert1(threw);
+	assert1(full_device == nullptr);
+
+	// Anything else is read through the buffer, keeping what the reader doesn't eat
+	std::string source;
+	for (size_t index = 0; source.size() < 3 * read_buffer_size; ++index) source += std::to_string(index) + ", ";
+	for (size_t hold : {size_t(0), size_t(7), 2 * read_buffer_size})
+	{
+		int ends[2];
+		assert2(pipe(ends), 0);
+		std::thread writer([&](void)
+		{
+			for (size_t done = 0; done < source.size(); done += 4096)
+				write_exact(ends[1], &source[done], std::min(size_t(4096), source.size() - done));
+			close(ends[1]);
+		});
+		recording_reader reader{hold};
+		feed_file(reader, "/dev/fd/" + std::to_string(ends[0]));
+		writer.join();
+		close(ends[0]);
+		assert1(reader.fed == source);
+		assert1(reader.feeds > 1);
+		assert2(reader.finishes, size_t(1));
+	}
+
+	for (auto const &path : {empty, full}) unlink(path.c_str());
+	rmdir(directory.c_str());
+
+	// Only root arrays are streamed by element, found even when fed a byte at a time
+	auto sniff = [](std::string const &text, bool whole)
+	{
+		root_sniffer sniffer;
+		if (whole) sniffer.feed(text.data(), text.size(), true);
+		else for (size_t length = 0; !sniffer.decided; ++length) 
+			sniffer.feed(text.data(), std::min(length, text.size()), length >= text.size());
+		return sniffer.array;
+	};
+	for (bool whole : {true, false})
+	{
+		assert1(sniff("[a, b]", whole));
+		assert1(sniff(" \n(t) *note (x) \\* ]* [a]", whole));
+		assert1(sniff("(a\\)b) []", whole));
+		assert1(!sniff("{k: [a]}", whole));
+		assert1(!sniff("(t) a", whole));
+		assert1(!sniff("*[* {}", whole));
+		assert1(!sniff("", whole));
+	}
+}
+
+void test_serve_framing(void)
+{
+	int ends[2];
+	assert2(socketpair(AF_UNIX, SOCK_STREAM, 0, ends), 0);
+	auto const client = ends[0], server = ends[1];
+
+	// Requests round trip, with an empty source
+	write_request(client, {"list", true, "[a, b]"});
+	write_request(client, {"other", false, ""});
+	serve_request request;
+	assert1(read_request(server, request));
+	assert2(request.name, std::string("list"));
+	assert2(request.reverse, true);
+	assert2(request.source, std::string("[a, b]"));
+	assert1(read_request(server, request));
+	assert2(request.name, std::string("other"));
+	assert2(request.reverse, false);
+	assert2(request.source, std::string());
+
+	// Lengths are big endian
+	std::string const raw("\0\0\0\2ab\1\0\0\0\1x", 12);
+	write_exact(client, raw.data(), raw.size());
+	assert1(read_request(server, request));
+	assert2(request.name, std::string("ab"));
+	assert2(request.reverse, true);
+	assert2(request.source, std::string("x"));
+
+	write_response(server, false, "done");
+	write_response(server, true, "Bad.");
+	std::string body;
+	assert1(read_response(client, body));
+	assert2(body, std::string("done"));
+	assert1(!read_response(client, body));
+	assert2(body, std::string("Bad."));
+
+	write_response(server, false, "ok");
+	char header[5];
+	read_required(client, header, sizeof(header));
+	assert2(std::string(header, sizeof(header)), std::string("\0\0\0\0\2", 5));
+
+	// Oversized fields are refused before reading them
+	std::string const huge("\xff\xff\xff\xff", 4);
+	write_exact(client, huge.data(), huge.size());
+	bool threw = false;
+	try { read_request(server, request); }
+	catch (std::runtime_error &) { threw = true; }
+	assert1(threw);
+
+	// Closing between requests ends the connection, closing during one is an error
+	write_exact(client, "\0\0", 2);
+	shutdown(client, SHUT_WR);
+	threw = false;
+	try { read_request(server, request); }
+	catch (std::runtime_error &) { threw = true; }
+	assert1(threw);
+	close(client);
+	close(server);
+
+	assert2(socketpair(AF_UNIX, SOCK_STREAM, 0, ends), 0);
+	close(ends[0]);
+	assert1(!read_request(ends[1], request));
+	close(ends[1]);
 }
 
 int main(void)
@@ -637,7 +2004,26 @@ int main(void)
 	test_alts();
 	test_subtransforms();
 	test_regexes();
+	test_regex_pool();
 	test_format();
+	test_traversal();
+	test_scope();
+	test_sequences();
+	test_partial();
+	test_memo();
+	test_share_output();
+	test_concurrent_apply();
+	test_stream_elements();
+	test_binary();
+	test_profile();
+	test_subtree_summaries();
+	test_transform_index();
+	test_validate();
+	test_optimize();
+	test_resumable_apply();
+	test_emit();
+	test_cli_io();
+	test_serve_framing();
 
 	return 0;
 }